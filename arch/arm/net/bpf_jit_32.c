@@ -11,6 +11,7 @@
 #include <linux/compiler.h>
 #include <linux/errno.h>
 #include <linux/filter.h>
+#include <linux/math64.h>
 #include <linux/netdevice.h>
 #include <linux/string.h>
 #include <linux/slab.h>
@@ -70,6 +71,8 @@
 #define CALLEE_PUSH_MASK (CALLEE_MASK | 1 << ARM_LR)
 #define CALLEE_POP_MASK  (CALLEE_MASK | 1 << ARM_PC)
 
+#define CALLER_MASK	(1 << ARM_R0 | 1 << ARM_R1 | 1 << ARM_R2 | 1 << ARM_R3)
+
 enum {
 	/* Stack layout - these are offsets from (top of stack - 4) */
 	BPF_R2_HI,
@@ -183,6 +186,13 @@ static const s8 bpf2a32[][2] = {
  * imm_count		:	no of immediate counts used for global
  *				variables.
  * imms			:	array of global variable addresses.
+ * jmp_targets		:	bitmap of eBPF instructions that are
+ *				jump targets.
+ * cached_reg		:	stacked register last stored from TMP_REG_1.
+ * cached_idx		:	value of idx right after that store.
+ * hi_zero		:	BPF registers whose upper half is zero.
+ * dst_hi_zero		:	hi_zero included the dst of this insn.
+ * src_hi_zero		:	the src or imm of this insn has a zero upper half.
  */
 
 struct jit_ctx {
@@ -195,6 +205,13 @@ struct jit_ctx {
 	u32 *offsets;
 	u32 *target;
 	u32 stack_size;
+	unsigned long *jmp_targets;
+	int out_offset; /* tail call exit, set on the first pass of build_body() */
+	s8 cached_reg;
+	u32 cached_idx;
+	u16 hi_zero;
+	bool dst_hi_zero;
+	bool src_hi_zero;
 #if __LINUX_ARM_ARCH__ < 7
 	u16 epilogue_bytes;
 	u16 imm_count;
@@ -422,12 +439,19 @@ static inline void emit_mov_i_no8m(const u8 rd, u32 val, struct jit_ctx *ctx)
 #endif
 }
 
+/*
+ * Move an immediate to a core register.  Values whose complement is an
+ * imm8m, such as sign-extended small negatives, take a single mvn.
+ */
 static inline void emit_mov_i(const u8 rd, u32 val, struct jit_ctx *ctx)
 {
 	int imm12 = imm8m(val);
+	int inv12 = imm8m(~val);
 
 	if (imm12 >= 0)
 		emit(ARM_MOV_I(rd, imm12), ctx);
+	else if (inv12 >= 0)
+		emit(ARM_MVN_I(rd, inv12), ctx);
 	else
 		emit_mov_i_no8m(rd, val, ctx);
 }
@@ -511,12 +535,88 @@ static inline void emit_udivmod(u8 rd, u8 rm, u8 rn, struct jit_ctx *ctx, u8 op)
 		emit(ARM_MOV_R(ARM_R0, tmp[1]), ctx);
 }
 
+/* There is no 64-bit divide instruction, so call bpf_jit_udiv64 or
+ * bpf_jit_mod64 with the dividend in {r1, r0} and the divisor in {r3, r2}.
+ */
+static void emit_udivmod64(const s8 *rd, const s8 *rm, const s8 *rn,
+			   struct jit_ctx *ctx, u8 op)
+{
+	/* Push caller-saved registers on stack */
+	emit(ARM_PUSH(CALLER_MASK), ctx);
+
+	if (rm[1] != ARM_R0 && rn[1] == ARM_R0) {
+		/* Rn is in {r1, r0}: move it to {r3, r2} via the stack. */
+		emit(ARM_PUSH(1 << ARM_R0 | 1 << ARM_R1), ctx);
+		emit(ARM_MOV_R(ARM_R1, rm[0]), ctx);
+		emit(ARM_MOV_R(ARM_R0, rm[1]), ctx);
+		emit(ARM_POP(1 << ARM_R2 | 1 << ARM_R3), ctx);
+	} else {
+		if (rm[1] != ARM_R0) {
+			emit(ARM_MOV_R(ARM_R1, rm[0]), ctx);
+			emit(ARM_MOV_R(ARM_R0, rm[1]), ctx);
+		}
+		if (rn[1] != ARM_R2) {
+			emit(ARM_MOV_R(ARM_R3, rn[0]), ctx);
+			emit(ARM_MOV_R(ARM_R2, rn[1]), ctx);
+		}
+	}
+
+	/* Call appropriate function */
+	emit_mov_i(ARM_IP, op == BPF_DIV ?
+		   (u32)bpf_jit_udiv64 : (u32)bpf_jit_mod64, ctx);
+	emit_blx_r(ARM_IP, ctx);
+
+	/* Save return value */
+	if (rd[1] != ARM_R0) {
+		emit(ARM_MOV_R(rd[0], ARM_R1), ctx);
+		emit(ARM_MOV_R(rd[1], ARM_R0), ctx);
+	}
+
+	/* Recover {r3, r2} and {r1, r0} unless they hold Rd */
+	if (rd[1] != ARM_R0 && rd[1] != ARM_R2) {
+		emit(ARM_POP(CALLER_MASK), ctx);
+	} else if (rd[1] != ARM_R0) {
+		emit(ARM_POP(1 << ARM_R0 | 1 << ARM_R1), ctx);
+		emit(ARM_ADD_I(ARM_SP, ARM_SP, imm8m(8)), ctx);
+	} else {
+		emit(ARM_ADD_I(ARM_SP, ARM_SP, imm8m(8)), ctx);
+		emit(ARM_POP(1 << ARM_R2 | 1 << ARM_R3), ctx);
+	}
+}
+
 /* Is the translated BPF register on stack? */
 static bool is_stacked(s8 reg)
 {
 	return reg < 0;
 }
 
+/* TMP_REG_1 still holds the stacked register last stored from it if
+ * nothing has been emitted since, so the register need not be loaded.
+ */
+static bool is_cached(const s8 *reg, const s8 *tmp, struct jit_ctx *ctx)
+{
+	return tmp == bpf2a32[TMP_REG_1] && ctx->cached_reg == reg[1] &&
+	       ctx->cached_idx == ctx->idx;
+}
+
+/* The upper half of dst must be cleared, unless the verifier inserts zext
+ * instructions or it is known to be zero already.
+ */
+static bool need_zext(const struct jit_ctx *ctx)
+{
+	return !ctx->prog->aux->verifier_zext && !ctx->dst_hi_zero;
+}
+
+/*
+ * ALU64 MOV/AND/OR/XOR keep the upper half of dst zero if both operands
+ * have zero upper halves, so only the lower halves need to be computed.
+ */
+static bool alu64_lo32_only(const struct jit_ctx *ctx, u8 op)
+{
+	return ctx->dst_hi_zero && ctx->src_hi_zero &&
+	       (op == BPF_MOV || op == BPF_AND || op == BPF_OR || op == BPF_XOR);
+}
+
 /* If a BPF register is on the stack (stk is true), load it to the
  * supplied temporary register and return the temporary register
  * for subsequent operations, otherwise just use the CPU register.
@@ -534,8 +634,10 @@ static const s8 *arm_bpf_get_reg64(const s8 *reg, const s8 *tmp,
 				   struct jit_ctx *ctx)
 {
 	if (is_stacked(reg[1])) {
-		if (__LINUX_ARM_ARCH__ >= 6 ||
-		    ctx->cpu_architecture >= CPU_ARCH_ARMv5TE) {
+		if (is_cached(reg, tmp, ctx)) {
+			/* Already in TMP_REG_1. */
+		} else if (__LINUX_ARM_ARCH__ >= 6 ||
+			   ctx->cpu_architecture >= CPU_ARCH_ARMv5TE) {
 			emit(ARM_LDRD_I(tmp[1], ARM_FP,
 					EBPF_SCRATCH_TO_ARM_FP(reg[1])), ctx);
 		} else {
@@ -575,6 +677,10 @@ static void arm_bpf_put_reg64(const s8 *reg, const s8 *src,
 			emit(ARM_STR_I(src[0], ARM_FP,
 				       EBPF_SCRATCH_TO_ARM_FP(reg[0])), ctx);
 		}
+		if (src == bpf2a32[TMP_REG_1]) {
+			ctx->cached_reg = reg[1];
+			ctx->cached_idx = ctx->idx;
+		}
 	} else {
 		if (reg[1] != src[1])
 			emit(ARM_MOV_R(reg[1], src[1]), ctx);
@@ -617,6 +723,15 @@ static inline void emit_a32_mov_se_i64(const bool is64, const s8 dst[],
 	emit_a32_mov_i64(dst, val64, ctx);
 }
 
+/* Load an ALU source immediate; only its lower half if the upper is zero. */
+static inline void emit_a32_mov_src_i(const bool is64, const s8 dst[],
+				      const u32 val, struct jit_ctx *ctx) {
+	if (ctx->src_hi_zero)
+		emit_a32_mov_i(dst_lo, val, ctx);
+	else
+		emit_a32_mov_se_i64(is64, dst, val, ctx);
+}
+
 static inline void emit_a32_add_r(const u8 dst, const u8 src,
 			      const bool is64, const bool hi,
 			      struct jit_ctx *ctx) {
@@ -709,7 +824,9 @@ static inline void emit_a32_alu_r(const s8 dst, const s8 src,
 	arm_bpf_put_reg32(dst, rd, ctx);
 }
 
-/* ALU operation (64 bit) */
+/* ALU operation (64 bit)
+ * The upper half of src is neither loaded nor used if it is zero.
+ */
 static inline void emit_a32_alu_r64(const bool is64, const s8 dst[],
 				  const s8 src[], struct jit_ctx *ctx,
 				  const u8 op) {
@@ -717,8 +834,13 @@ static inline void emit_a32_alu_r64(const bool is64, const s8 dst[],
 	const s8 *tmp2 = bpf2a32[TMP_REG_2];
 	const s8 *rd;
 
+	if (is64 && alu64_lo32_only(ctx, op)) {
+		emit_a32_alu_r(dst_lo, src_lo, ctx, false, false, op);
+		return;
+	}
+
 	rd = arm_bpf_get_reg64(dst, tmp, ctx);
-	if (is64) {
+	if (is64 && !ctx->src_hi_zero) {
 		const s8 *rs;
 
 		rs = arm_bpf_get_reg64(src, tmp2, ctx);
@@ -733,8 +855,23 @@ static inline void emit_a32_alu_r64(const bool is64, const s8 dst[],
 
 		/* ALU operation */
 		emit_alu_r(rd[1], rs, true, false, op, ctx);
-		if (!ctx->prog->aux->verifier_zext)
-			emit_a32_mov_i(rd[0], 0, ctx);
+		if (!is64) {
+			if (need_zext(ctx))
+				emit_a32_mov_i(rd[0], 0, ctx);
+		} else {
+			switch (op) {
+			case BPF_ADD:
+				emit(ARM_ADC_I(rd[0], rd[0], 0), ctx);
+				break;
+			case BPF_SUB:
+				emit(ARM_SBC_I(rd[0], rd[0], 0), ctx);
+				break;
+			case BPF_AND:
+				emit(ARM_MOV_I(rd[0], 0), ctx);
+				break;
+			/* OR/XOR leave the upper half as is. */
+			}
+		}
 	}
 
 	arm_bpf_put_reg64(dst, rd, ctx);
@@ -754,9 +891,9 @@ static inline void emit_a32_mov_r(const s8 dst, const s8 src,
 static inline void emit_a32_mov_r64(const bool is64, const s8 dst[],
 				  const s8 src[],
 				  struct jit_ctx *ctx) {
-	if (!is64) {
+	if (!is64 || alu64_lo32_only(ctx, BPF_MOV)) {
 		emit_a32_mov_r(dst_lo, src_lo, ctx);
-		if (!ctx->prog->aux->verifier_zext)
+		if (need_zext(ctx))
 			/* Zero out high 4 bytes */
 			emit_a32_mov_i(dst_hi, 0, ctx);
 	} else if (__LINUX_ARM_ARCH__ < 6 &&
@@ -942,10 +1079,12 @@ static inline void emit_a32_rsh_i64(const s8 dst[],
 		emit(ARM_MOV_SI(rd[0], rd[0], SRTYPE_LSR, val), ctx);
 	} else if (val == 32) {
 		emit(ARM_MOV_R(rd[1], rd[0]), ctx);
-		emit(ARM_MOV_I(rd[0], 0), ctx);
+		if (!ctx->dst_hi_zero)
+			emit(ARM_MOV_I(rd[0], 0), ctx);
 	} else {
 		emit(ARM_MOV_SI(rd[1], rd[0], SRTYPE_LSR, val - 32), ctx);
-		emit(ARM_MOV_I(rd[0], 0), ctx);
+		if (!ctx->dst_hi_zero)
+			emit(ARM_MOV_I(rd[0], 0), ctx);
 	}
 
 	arm_bpf_put_reg64(dst, rd, ctx);
@@ -986,17 +1125,24 @@ static inline void emit_a32_mul_r64(const s8 dst[], const s8 src[],
 	const s8 *tmp = bpf2a32[TMP_REG_1];
 	const s8 *tmp2 = bpf2a32[TMP_REG_2];
 	const s8 *rd, *rt;
+	s8 rs;
 
 	/* Setup operands for multiplication */
 	rd = arm_bpf_get_reg64(dst, tmp, ctx);
-	rt = arm_bpf_get_reg64(src, tmp2, ctx);
 
 	/* Do Multiplication */
-	emit(ARM_MUL(ARM_IP, rd[1], rt[0]), ctx);
-	emit(ARM_MUL(ARM_LR, rd[0], rt[1]), ctx);
-	emit(ARM_ADD_R(ARM_LR, ARM_IP, ARM_LR), ctx);
-
-	emit(ARM_UMULL(ARM_IP, rd[0], rd[1], rt[1]), ctx);
+	if (ctx->src_hi_zero) {
+		/* The cross product with the upper half of src is zero. */
+		rs = arm_bpf_get_reg32(src_lo, tmp2[1], ctx);
+		emit(ARM_MUL(ARM_LR, rd[0], rs), ctx);
+		emit(ARM_UMULL(ARM_IP, rd[0], rd[1], rs), ctx);
+	} else {
+		rt = arm_bpf_get_reg64(src, tmp2, ctx);
+		emit(ARM_MUL(ARM_IP, rd[1], rt[0]), ctx);
+		emit(ARM_MUL(ARM_LR, rd[0], rt[1]), ctx);
+		emit(ARM_ADD_R(ARM_LR, ARM_IP, ARM_LR), ctx);
+		emit(ARM_UMULL(ARM_IP, rd[0], rd[1], rt[1]), ctx);
+	}
 	emit(ARM_ADD_R(rd[0], ARM_LR, rd[0]), ctx);
 
 	arm_bpf_put_reg32(dst_lo, ARM_IP, ctx);
@@ -1078,19 +1224,19 @@ static inline void emit_ldx_r(const s8 dst[], const s8 src,
 	case BPF_B:
 		/* Load a Byte */
 		emit(ARM_LDRB_I(rd[1], rm, off), ctx);
-		if (!ctx->prog->aux->verifier_zext)
+		if (need_zext(ctx))
 			emit_a32_mov_i(rd[0], 0, ctx);
 		break;
 	case BPF_H:
 		/* Load a HalfWord */
 		emit(ARM_LDRH_I(rd[1], rm, off), ctx);
-		if (!ctx->prog->aux->verifier_zext)
+		if (need_zext(ctx))
 			emit_a32_mov_i(rd[0], 0, ctx);
 		break;
 	case BPF_W:
 		/* Load a Word */
 		emit(ARM_LDR_I(rd[1], rm, off), ctx);
-		if (!ctx->prog->aux->verifier_zext)
+		if (need_zext(ctx))
 			emit_a32_mov_i(rd[0], 0, ctx);
 		break;
 	case BPF_DW:
@@ -1145,7 +1291,6 @@ static inline void emit_ar_r(const u8 rd, const u8 rt, const u8 rm,
 	}
 }
 
-static int out_offset = -1; /* initialized on the first pass of build_body() */
 static int emit_bpf_tail_call(struct jit_ctx *ctx)
 {
 
@@ -1158,7 +1303,7 @@ static int emit_bpf_tail_call(struct jit_ctx *ctx)
 	const s8 *tc;
 	const int idx0 = ctx->idx;
 #define cur_offset (ctx->idx - idx0)
-#define jmp_offset (out_offset - (cur_offset) - 2)
+#define jmp_offset (ctx->out_offset - (cur_offset) - 2)
 	u32 lo, hi;
 	s8 r_array, r_index;
 	int off;
@@ -1214,11 +1359,11 @@ static int emit_bpf_tail_call(struct jit_ctx *ctx)
 	emit_bx_r(tmp[1], ctx);
 
 	/* out: */
-	if (out_offset == -1)
-		out_offset = cur_offset;
-	if (cur_offset != out_offset) {
+	if (ctx->out_offset == -1)
+		ctx->out_offset = cur_offset;
+	if (cur_offset != ctx->out_offset) {
 		pr_err_once("tail_call out_offset = %d, expected %d!\n",
-			    cur_offset, out_offset);
+			    cur_offset, ctx->out_offset);
 		return -1;
 	}
 	return 0;
@@ -1356,6 +1501,17 @@ static int build_insn(const struct bpf_insn *insn, struct jit_ctx *ctx)
 	s8 rd_lo, rt, rm, rn;
 	s32 jmp_offset;
 
+	/* TMP_REG_1 and upper halves are unknown on entry and at jump targets. */
+	if (!i || test_bit(i, ctx->jmp_targets)) {
+		ctx->cached_reg = 0;
+		ctx->hi_zero = 0;
+	}
+	ctx->dst_hi_zero = ctx->hi_zero & BIT(insn->dst_reg);
+	ctx->src_hi_zero = BPF_SRC(code) == BPF_K ? imm >= 0 :
+			   ctx->hi_zero & BIT(insn->src_reg);
+	ctx->hi_zero = bpf_jit_hi_zero_next(insn, ctx->hi_zero,
+					    ctx->prog->aux->verifier_zext);
+
 #define check_imm(bits, imm) do {				\
 	if ((imm) >= (1 << ((bits) - 1)) ||			\
 	    (imm) < -(1 << ((bits) - 1))) {			\
@@ -1378,14 +1534,18 @@ static int build_insn(const struct bpf_insn *insn, struct jit_ctx *ctx)
 		case BPF_X:
 			if (imm == 1) {
 				/* Special mov32 for zext */
-				emit_a32_mov_i(dst_hi, 0, ctx);
+				if (!ctx->dst_hi_zero)
+					emit_a32_mov_i(dst_hi, 0, ctx);
 				break;
 			}
 			emit_a32_mov_r64(is64, dst, src, ctx);
 			break;
 		case BPF_K:
 			/* Sign-extend immediate value to destination reg */
-			emit_a32_mov_se_i64(is64, dst, imm, ctx);
+			if (is64 && alu64_lo32_only(ctx, BPF_MOV))
+				emit_a32_mov_i(dst_lo, imm, ctx);
+			else
+				emit_a32_mov_se_i64(is64, dst, imm, ctx);
 			break;
 		}
 		break;
@@ -1433,7 +1593,7 @@ static int build_insn(const struct bpf_insn *insn, struct jit_ctx *ctx)
 			 * value into temporary reg and then it would be
 			 * safe to do the operation on it.
 			 */
-			emit_a32_mov_se_i64(is64, tmp2, imm, ctx);
+			emit_a32_mov_src_i(is64, tmp2, imm, ctx);
 			emit_a32_alu_r64(is64, dst, tmp2, ctx, BPF_OP(code));
 			break;
 		}
@@ -1459,14 +1619,26 @@ static int build_insn(const struct bpf_insn *insn, struct jit_ctx *ctx)
 		}
 		emit_udivmod(rd_lo, rd_lo, rt, ctx, BPF_OP(code));
 		arm_bpf_put_reg32(dst_lo, rd_lo, ctx);
-		if (!ctx->prog->aux->verifier_zext)
+		if (need_zext(ctx))
 			emit_a32_mov_i(dst_hi, 0, ctx);
 		break;
 	case BPF_ALU64 | BPF_DIV | BPF_K:
 	case BPF_ALU64 | BPF_DIV | BPF_X:
 	case BPF_ALU64 | BPF_MOD | BPF_K:
 	case BPF_ALU64 | BPF_MOD | BPF_X:
-		goto notyet;
+		rd = arm_bpf_get_reg64(dst, tmp2, ctx);
+		switch (BPF_SRC(code)) {
+		case BPF_X:
+			rs = arm_bpf_get_reg64(src, tmp, ctx);
+			break;
+		case BPF_K:
+			rs = tmp;
+			emit_a32_mov_se_i64(is64, rs, imm, ctx);
+			break;
+		}
+		emit_udivmod64(rd, rd, rs, ctx, BPF_OP(code));
+		arm_bpf_put_reg64(dst, rd, ctx);
+		break;
 	/* dst = dst << imm */
 	/* dst = dst >> imm */
 	/* dst = dst >> imm (signed) */
@@ -1477,7 +1649,7 @@ static int build_insn(const struct bpf_insn *insn, struct jit_ctx *ctx)
 			return -EINVAL;
 		if (imm)
 			emit_a32_alu_i(dst_lo, imm, ctx, BPF_OP(code));
-		if (!ctx->prog->aux->verifier_zext)
+		if (need_zext(ctx))
 			emit_a32_mov_i(dst_hi, 0, ctx);
 		break;
 	/* dst = dst << imm */
@@ -1513,7 +1685,7 @@ static int build_insn(const struct bpf_insn *insn, struct jit_ctx *ctx)
 	/* dst = ~dst */
 	case BPF_ALU | BPF_NEG:
 		emit_a32_alu_i(dst_lo, 0, ctx, BPF_OP(code));
-		if (!ctx->prog->aux->verifier_zext)
+		if (need_zext(ctx))
 			emit_a32_mov_i(dst_hi, 0, ctx);
 		break;
 	/* dst = ~dst (64 bit) */
@@ -1534,7 +1706,7 @@ static int build_insn(const struct bpf_insn *insn, struct jit_ctx *ctx)
 			 * reg then it would be safe to do the operation
 			 * on it.
 			 */
-			emit_a32_mov_se_i64(is64, tmp2, imm, ctx);
+			emit_a32_mov_src_i(is64, tmp2, imm, ctx);
 			emit_a32_mul_r64(dst, tmp2, ctx);
 			break;
 		}
@@ -1570,12 +1742,12 @@ emit_bswap_uxt:
 #else /* ARMv6+ */
 			emit(ARM_UXTH(rd[1], rd[1]), ctx);
 #endif
-			if (!ctx->prog->aux->verifier_zext)
+			if (need_zext(ctx))
 				emit(ARM_EOR_R(rd[0], rd[0], rd[0]), ctx);
 			break;
 		case 32:
 			/* zero-extend 32 bits into 64 bits */
-			if (!ctx->prog->aux->verifier_zext)
+			if (need_zext(ctx))
 				emit(ARM_EOR_R(rd[0], rd[0], rd[0]), ctx);
 			break;
 		case 64:
@@ -1903,6 +2075,7 @@ struct bpf_prog *bpf_int_jit_compile(struct bpf_prog *prog)
 	memset(&ctx, 0, sizeof(ctx));
 	ctx.prog = prog;
 	ctx.cpu_architecture = cpu_architecture();
+	ctx.out_offset = -1;
 
 	/* Not able to allocate memory for offsets[] , then
 	 * we must fall back to the interpreter
@@ -1913,6 +2086,13 @@ struct bpf_prog *bpf_int_jit_compile(struct bpf_prog *prog)
 		goto out;
 	}
 
+	ctx.jmp_targets = bitmap_zalloc(prog->len, GFP_KERNEL);
+	if (ctx.jmp_targets == NULL) {
+		prog = orig_prog;
+		goto out_off;
+	}
+	bpf_jit_mark_jmp_targets(prog->insnsi, prog->len, ctx.jmp_targets);
+
 	/* 1) fake pass to find in the length of the JITed code,
 	 * to compute ctx->offsets and other context variables
 	 * needed to compute final JITed code.
@@ -2013,6 +2193,7 @@ out_imms:
 		kfree(ctx.imms);
 #endif
 out_off:
+	bitmap_free(ctx.jmp_targets);
 	kfree(ctx.offsets);
 out:
 	if (tmp_blinded)
@@ -566,6 +566,45 @@ u32 aarch64_insn_gen_comp_branch_imm(unsigned long pc, unsigned long addr,
 					     offset >> 2);
 }
 
+u32 aarch64_insn_gen_test_branch_imm(unsigned long pc, unsigned long addr,
+				     enum aarch64_insn_register reg,
+				     unsigned int bit,
+				     enum aarch64_insn_branch_type type)
+{
+	u32 insn;
+	long offset;
+
+	offset = branch_imm_common(pc, addr, SZ_32K);
+	if (offset >= SZ_32K)
+		return AARCH64_BREAK_FAULT;
+
+	switch (type) {
+	case AARCH64_INSN_BRANCH_TEST_ZERO:
+		insn = aarch64_insn_get_tbz_value();
+		break;
+	case AARCH64_INSN_BRANCH_TEST_NONZERO:
+		insn = aarch64_insn_get_tbnz_value();
+		break;
+	default:
+		pr_err("%s: unknown branch encoding %d\n", __func__, type);
+		return AARCH64_BREAK_FAULT;
+	}
+
+	if (bit >= 64) {
+		pr_err("%s: invalid bit number %u\n", __func__, bit);
+		return AARCH64_BREAK_FAULT;
+	}
+
+	/* b5 goes in bit 31, b40 in bits 23:19 */
+	insn |= (bit & 0x20) << 26;
+	insn |= (bit & 0x1f) << 19;
+
+	insn = aarch64_insn_encode_register(AARCH64_INSN_REGTYPE_RT, insn, reg);
+
+	return aarch64_insn_encode_immediate(AARCH64_INSN_IMM_14, insn,
+					     offset >> 2);
+}
+
 u32 aarch64_insn_gen_cond_branch_imm(unsigned long pc, unsigned long addr,
 				     enum aarch64_insn_condition cond)
 {
@@ -673,6 +712,12 @@ u32 aarch64_insn_gen_load_store_pair(enum aarch64_insn_register reg1,
 	case AARCH64_INSN_LDST_STORE_PAIR_POST_INDEX:
 		insn = aarch64_insn_get_stp_post_value();
 		break;
+	case AARCH64_INSN_LDST_LOAD_PAIR_SIGNED_OFFSET:
+		insn = aarch64_insn_get_ldp_value();
+		break;
+	case AARCH64_INSN_LDST_STORE_PAIR_SIGNED_OFFSET:
+		insn = aarch64_insn_get_stp_value();
+		break;
 	default:
 		pr_err("%s: unknown load/store encoding %d\n", __func__, type);
 		return AARCH64_BREAK_FAULT;
@@ -1197,6 +1242,13 @@ u32 aarch64_insn_gen_data3(enum aarch64_insn_register dst,
 	case AARCH64_INSN_DATA3_MSUB:
 		insn = aarch64_insn_get_msub_value();
 		break;
+	case AARCH64_INSN_DATA3_UMULH:
+		if (variant != AARCH64_INSN_VARIANT_64BIT) {
+			pr_err("%s: umulh has no 32-bit variant\n", __func__);
+			return AARCH64_BREAK_FAULT;
+		}
+		insn = aarch64_insn_get_umulh_value();
+		break;
 	default:
 		pr_err("%s: unknown data3 encoding %d\n", __func__, type);
 		return AARCH64_BREAK_FAULT;
@@ -1224,6 +1276,58 @@ u32 aarch64_insn_gen_data3(enum aarch64_insn_register dst,
 					    reg2);
 }
 
+u32 aarch64_insn_gen_cond_select(enum aarch64_insn_register dst,
+				 enum aarch64_insn_register src1,
+				 enum aarch64_insn_register src2,
+				 enum aarch64_insn_condition cond,
+				 enum aarch64_insn_variant variant,
+				 enum aarch64_insn_condsel_type type)
+{
+	u32 insn;
+
+	switch (type) {
+	case AARCH64_INSN_CONDSEL_CSEL:
+		insn = aarch64_insn_get_csel_value();
+		break;
+	case AARCH64_INSN_CONDSEL_CSINC:
+		insn = aarch64_insn_get_csinc_value();
+		break;
+	case AARCH64_INSN_CONDSEL_CSINV:
+		insn = aarch64_insn_get_csinv_value();
+		break;
+	case AARCH64_INSN_CONDSEL_CSNEG:
+		insn = aarch64_insn_get_csneg_value();
+		break;
+	default:
+		pr_err("%s: unknown condsel encoding %d\n", __func__, type);
+		return AARCH64_BREAK_FAULT;
+	}
+
+	switch (variant) {
+	case AARCH64_INSN_VARIANT_32BIT:
+		break;
+	case AARCH64_INSN_VARIANT_64BIT:
+		insn |= AARCH64_INSN_SF_BIT;
+		break;
+	default:
+		pr_err("%s: unknown variant encoding %d\n", __func__, variant);
+		return AARCH64_BREAK_FAULT;
+	}
+
+	if (cond < AARCH64_INSN_COND_EQ || cond > AARCH64_INSN_COND_AL) {
+		pr_err("%s: unknown condition encoding %d\n", __func__, cond);
+		return AARCH64_BREAK_FAULT;
+	}
+	insn |= cond << 12;
+
+	insn = aarch64_insn_encode_register(AARCH64_INSN_REGTYPE_RD, insn, dst);
+
+	insn = aarch64_insn_encode_register(AARCH64_INSN_REGTYPE_RN, insn, src1);
+
+	return aarch64_insn_encode_register(AARCH64_INSN_REGTYPE_RM, insn,
+					    src2);
+}
+
 u32 aarch64_insn_gen_logical_shifted_reg(enum aarch64_insn_register dst,
 					 enum aarch64_insn_register src,
 					 enum aarch64_insn_register reg,
@@ -1533,21 +1637,12 @@ pstate_check_t * const aarch32_opcode_cond_checks[16] = {
 	__check_gt, __check_le, __check_al, __check_al
 };
 
-static bool range_of_ones(u64 val)
-{
-	/* Doesn't handle full ones or full zeroes */
-	u64 sval = val >> __ffs64(val);
-
-	/* One of Sean Eron Anderson's bithack tricks */
-	return ((sval + 1) & (sval)) == 0;
-}
-
 static u32 aarch64_encode_immediate(u64 imm,
 				    enum aarch64_insn_variant variant,
 				    u32 insn)
 {
-	unsigned int immr, imms, n, ones, ror, esz, tmp;
-	u64 mask;
+	unsigned int immr, imms, n, ones, zeroes, ror, esz;
+	u64 mask, tmp;
 
 	switch (variant) {
 	case AARCH64_INSN_VARIANT_32BIT:
@@ -1568,70 +1663,46 @@ static u32 aarch64_encode_immediate(u64 imm,
 	if (!imm || imm == mask || imm & ~mask)
 		return AARCH64_BREAK_FAULT;
 
+	/* Replicate a 32bit value so that both variants share the 64bit path */
+	if (esz == 32)
+		imm |= imm << 32;
+
 	/*
-	 * Inverse of Replicate(). Try to spot a repeating pattern
-	 * with a pow2 stride.
+	 * Rotate right so that bit 0 starts a run of ones and bit 63 ends a
+	 * run of zeroes: imm & (imm + 1) clears the ones at the bottom, and
+	 * its lowest set bit starts a run of ones with a zero below it.
 	 */
-	for (tmp = esz / 2; tmp >= 2; tmp /= 2) {
-		u64 emask = BIT(tmp) - 1;
-
-		if ((imm & emask) != ((imm >> tmp) & emask))
-			break;
-
-		esz = tmp;
-		mask = emask;
-	}
-
-	/* N is only set if we're encoding a 64bit value */
-	n = esz == 64;
-
-	/* Trim imm to the element size */
-	imm &= mask;
-
-	/* That's how many ones we need to encode */
-	ones = hweight64(imm);
+	tmp = imm & (imm + 1);
+	ror = tmp ? __ffs64(tmp) : 0;
+	tmp = ror64(imm, ror);
 
 	/*
-	 * imms is set to (ones - 1), prefixed with a string of ones
-	 * and a zero if they fit. Cap it to 6 bits.
+	 * The element is that run of ones and the run of zeroes above it,
+	 * and imm must be a replication of it. As the smallest period of
+	 * imm divides 64, this also rejects element sizes that are not a
+	 * power of two.
 	 */
-	imms  = ones - 1;
-	imms |= 0xf << ffs(esz);
-	imms &= BIT(6) - 1;
-
-	/* Compute the rotation */
-	if (range_of_ones(imm)) {
-		/*
-		 * Pattern: 0..01..10..0
-		 *
-		 * Compute how many rotate we need to align it right
-		 */
-		ror = __ffs64(imm);
-	} else {
-		/*
-		 * Pattern: 0..01..10..01..1
-		 *
-		 * Fill the unused top bits with ones, and check if
-		 * the result is a valid immediate (all ones with a
-		 * contiguous ranges of zeroes).
-		 */
-		imm |= ~mask;
-		if (!range_of_ones(~imm))
-			return AARCH64_BREAK_FAULT;
+	ones = __ffs64(~tmp);
+	zeroes = 64 - fls64(tmp);
+	esz = ones + zeroes;
+	if (ror64(imm, esz % 64) != imm)
+		return AARCH64_BREAK_FAULT;
 
-		/*
-		 * Compute the rotation to get a continuous set of
-		 * ones, with the first bit set at position 0
-		 */
-		ror = fls(~imm);
-	}
+	/* N is only set if we're encoding a 64bit value */
+	n = esz == 64;
 
 	/*
 	 * immr is the number of bits we need to rotate back to the
 	 * original set of ones. Note that this is relative to the
 	 * element size...
 	 */
-	immr = (esz - ror) % esz;
+	immr = -ror & (esz - 1);
+
+	/*
+	 * imms is set to (ones - 1), prefixed with a string of ones
+	 * and a zero if they fit. Cap it to 6 bits.
+	 */
+	imms = (-(esz << 1) | (ones - 1)) & (BIT(6) - 1);
 
 	insn = aarch64_insn_encode_immediate(AARCH64_INSN_IMM_N, insn, n);
 	insn = aarch64_insn_encode_immediate(AARCH64_INSN_IMM_R, insn, immr);
@@ -26,6 +26,13 @@
 #define A64_CBZ(sf, Rt, imm19) A64_COMP_BRANCH(sf, Rt, (imm19) << 2, ZERO)
 #define A64_CBNZ(sf, Rt, imm19) A64_COMP_BRANCH(sf, Rt, (imm19) << 2, NONZERO)
 
+/* Test & branch (immediate) */
+#define A64_TEST_BRANCH(Rt, bit, offset, type) \
+	aarch64_insn_gen_test_branch_imm(0, offset, Rt, bit, \
+		AARCH64_INSN_BRANCH_TEST_##type)
+#define A64_TBZ(Rt, bit, imm14) A64_TEST_BRANCH(Rt, bit, (imm14) << 2, ZERO)
+#define A64_TBNZ(Rt, bit, imm14) A64_TEST_BRANCH(Rt, bit, (imm14) << 2, NONZERO)
+
 /* Conditional branch (immediate) */
 #define A64_COND_BRANCH(cond, offset) \
 	aarch64_insn_gen_cond_branch_imm(0, offset, cond)
@@ -39,6 +46,7 @@
 #define A64_COND_GT	AARCH64_INSN_COND_GT /* signed > */
 #define A64_COND_LE	AARCH64_INSN_COND_LE /* signed <= */
 #define A64_COND_LT	AARCH64_INSN_COND_LT /* signed < */
+#define A64_COND_AL	AARCH64_INSN_COND_AL /* always */
 #define A64_B_(cond, imm19) A64_COND_BRANCH(cond, (imm19) << 2)
 
 /* Unconditional branch (immediate) */
@@ -75,6 +83,12 @@
 #define A64_PUSH(Rt, Rt2, Rn) A64_LS_PAIR(Rt, Rt2, Rn, -16, STORE, PRE_INDEX)
 /* Rt = Rn[0]; Rt2 = Rn[8]; Rn += 16; */
 #define A64_POP(Rt, Rt2, Rn)  A64_LS_PAIR(Rt, Rt2, Rn, 16, LOAD, POST_INDEX)
+/* Rn[offset] = Rt; Rn[offset + 8] = Rt2; */
+#define A64_STP(Rt, Rt2, Rn, offset) \
+	A64_LS_PAIR(Rt, Rt2, Rn, offset, STORE, SIGNED_OFFSET)
+/* Rt = Rn[offset]; Rt2 = Rn[offset + 8]; */
+#define A64_LDP(Rt, Rt2, Rn, offset) \
+	A64_LS_PAIR(Rt, Rt2, Rn, offset, LOAD, SIGNED_OFFSET)
 
 /* Load/store exclusive */
 #define A64_SIZE(sf) \
@@ -184,6 +198,20 @@
 	A64_VARIANT(sf), AARCH64_INSN_DATA3_MSUB)
 /* Rd = Rn * Rm */
 #define A64_MUL(sf, Rd, Rn, Rm) A64_MADD(sf, Rd, A64_ZR, Rn, Rm)
+/* Rd = (Rn * Rm) >> 64, unsigned; 64-bit only */
+#define A64_UMULH(Rd, Rn, Rm) aarch64_insn_gen_data3(Rd, A64_ZR, Rn, Rm, \
+	A64_VARIANT(1), AARCH64_INSN_DATA3_UMULH)
+
+/* Conditional select */
+#define A64_COND_SEL(sf, Rd, Rn, Rm, cond, type) \
+	aarch64_insn_gen_cond_select(Rd, Rn, Rm, cond, \
+		A64_VARIANT(sf), AARCH64_INSN_CONDSEL_##type)
+/* Rd = cond ? Rn : Rm */
+#define A64_CSEL(sf, Rd, Rn, Rm, cond) A64_COND_SEL(sf, Rd, Rn, Rm, cond, CSEL)
+/* Rd = cond ? Rn : Rm + 1 */
+#define A64_CSINC(sf, Rd, Rn, Rm, cond) A64_COND_SEL(sf, Rd, Rn, Rm, cond, CSINC)
+/* Rd = cond ? Rn : -Rm */
+#define A64_CSNEG(sf, Rd, Rn, Rm, cond) A64_COND_SEL(sf, Rd, Rn, Rm, cond, CSNEG)
 
 /* Logical (shifted register) */
 #define A64_LOGIC_SREG(sf, Rd, Rn, Rm, type) \
@@ -214,6 +242,8 @@
 /* HINTs */
 #define A64_HINT(x) aarch64_insn_gen_hint(x)
 
+#define A64_NOP A64_HINT(AARCH64_INSN_HINT_NOP)
+
 /* BTI */
 #define A64_BTI_C  A64_HINT(AARCH64_INSN_HINT_BTIC)
 #define A64_BTI_J  A64_HINT(AARCH64_INSN_HINT_BTIJ)
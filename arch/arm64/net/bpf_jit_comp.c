@@ -10,6 +10,7 @@
 #include <linux/bitfield.h>
 #include <linux/bpf.h>
 #include <linux/filter.h>
+#include <linux/memory.h>
 #include <linux/printk.h>
 #include <linux/slab.h>
 
@@ -60,6 +61,9 @@ struct jit_ctx {
 	int exentry_idx;
 	__le32 *image;
 	u32 stack_size;
+	unsigned long *jmp_targets;
+	int out_offset; /* tail call exit, set on the first pass of build_body() */
+	bool use_tbz;
 };
 
 static inline void emit(const u32 insn, struct jit_ctx *ctx)
@@ -70,6 +74,18 @@ static inline void emit(const u32 insn, struct jit_ctx *ctx)
 	ctx->idx++;
 }
 
+/* Try to load a logical immediate with a single ORR from the zero register. */
+static inline bool emit_a64_orr_i(const int is64, const int reg,
+				  const u64 val, struct jit_ctx *ctx)
+{
+	u32 insn = A64_ORR_I(is64, reg, A64_ZR, val);
+
+	if (insn == AARCH64_BREAK_FAULT)
+		return false;
+	emit(insn, ctx);
+	return true;
+}
+
 static inline void emit_a64_mov_i(const int is64, const int reg,
 				  const s32 val, struct jit_ctx *ctx)
 {
@@ -79,15 +95,19 @@ static inline void emit_a64_mov_i(const int is64, const int reg,
 	if (hi & 0x8000) {
 		if (hi == 0xffff) {
 			emit(A64_MOVN(is64, reg, (u16)~lo, 0), ctx);
-		} else {
+		} else if (lo == 0xffff) {
+			emit(A64_MOVN(is64, reg, (u16)~hi, 16), ctx);
+		} else if (!emit_a64_orr_i(is64, reg, val, ctx)) {
 			emit(A64_MOVN(is64, reg, (u16)~hi, 16), ctx);
-			if (lo != 0xffff)
-				emit(A64_MOVK(is64, reg, lo, 0), ctx);
+			emit(A64_MOVK(is64, reg, lo, 0), ctx);
 		}
-	} else {
+	} else if (!hi) {
 		emit(A64_MOVZ(is64, reg, lo, 0), ctx);
-		if (hi)
-			emit(A64_MOVK(is64, reg, hi, 16), ctx);
+	} else if (!lo) {
+		emit(A64_MOVZ(is64, reg, hi, 16), ctx);
+	} else if (!emit_a64_orr_i(is64, reg, val, ctx)) {
+		emit(A64_MOVZ(is64, reg, lo, 0), ctx);
+		emit(A64_MOVK(is64, reg, hi, 16), ctx);
 	}
 }
 
@@ -99,6 +119,39 @@ static int i64_i16_blocks(const u64 val, bool inverse)
 	       (((val >> 48) & 0xffff) != (inverse ? 0xffff : 0x0000));
 }
 
+/*
+ * Try to load val with an ORR of a logical immediate that differs from val
+ * in a single 16-bit block, followed by a MOVK of that block.  The block is
+ * filled with the one 32 bits above it (for repeating patterns), or with
+ * all zeros or all ones (for a rotated run of ones).
+ */
+static bool emit_a64_orr_movk(const int reg, const u64 val,
+			      struct jit_ctx *ctx)
+{
+	int shift, i;
+
+	for (shift = 0; shift < 64; shift += 16) {
+		const u64 mask = 0xffffULL << shift;
+		const u64 fill[] = { ror64(val, 32) & mask, 0, mask };
+
+		for (i = 0; i < ARRAY_SIZE(fill); i++) {
+			u64 imm = (val & ~mask) | fill[i];
+			u32 insn = A64_ORR_I(1, reg, A64_ZR, imm);
+
+			if (insn == AARCH64_BREAK_FAULT)
+				continue;
+			emit(insn, ctx);
+			emit(A64_MOVK(1, reg, (val >> shift) & 0xffff, shift), ctx);
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Pick the shortest of a single ORR, a MOVZ/MOVN followed by MOVKs, and
+ * an ORR followed by a MOVK.
+ */
 static inline void emit_a64_mov_i64(const int reg, const u64 val,
 				    struct jit_ctx *ctx)
 {
@@ -109,7 +162,14 @@ static inline void emit_a64_mov_i64(const int reg, const u64 val,
 	if (!(nrm_tmp >> 32))
 		return emit_a64_mov_i(0, reg, (u32)val, ctx);
 
+	if (emit_a64_orr_i(1, reg, val, ctx))
+		return;
+
 	inverse = i64_i16_blocks(nrm_tmp, true) < i64_i16_blocks(nrm_tmp, false);
+	if (i64_i16_blocks(nrm_tmp, inverse) > 2 &&
+	    emit_a64_orr_movk(reg, val, ctx))
+		return;
+
 	shift = max(round_down((inverse ? (fls64(rev_tmp) - 1) :
 					  (fls64(nrm_tmp) - 1)), 16), 0);
 	if (inverse)
@@ -262,7 +322,6 @@ static int build_prologue(struct jit_ctx *ctx, bool ebpf_from_cbpf)
 	return 0;
 }
 
-static int out_offset = -1; /* initialized on the first pass of build_body() */
 static int emit_bpf_tail_call(struct jit_ctx *ctx)
 {
 	/* bpf_tail_call(void *prog_ctx, struct bpf_array *array, u64 index) */
@@ -274,7 +333,7 @@ static int emit_bpf_tail_call(struct jit_ctx *ctx)
 	const u8 tcc = bpf2a64[TCALL_CNT];
 	const int idx0 = ctx->idx;
 #define cur_offset (ctx->idx - idx0)
-#define jmp_offset (out_offset - (cur_offset))
+#define jmp_offset (ctx->out_offset - (cur_offset))
 	size_t off;
 
 	/* if (index >= array->map.max_entries)
@@ -289,12 +348,10 @@ static int emit_bpf_tail_call(struct jit_ctx *ctx)
 
 	/* if (tail_call_cnt > MAX_TAIL_CALL_CNT)
 	 *     goto out;
-	 * tail_call_cnt++;
 	 */
 	emit_a64_mov_i64(tmp, MAX_TAIL_CALL_CNT, ctx);
 	emit(A64_CMP(1, tcc, tmp), ctx);
 	emit(A64_B_(A64_COND_HI, jmp_offset), ctx);
-	emit(A64_ADD_I(1, tcc, tcc, 1), ctx);
 
 	/* prog = array->ptrs[index];
 	 * if (prog == NULL)
@@ -307,6 +364,9 @@ static int emit_bpf_tail_call(struct jit_ctx *ctx)
 	emit(A64_LDR64(prg, tmp, prg), ctx);
 	emit(A64_CBZ(1, prg, jmp_offset), ctx);
 
+	/* tail_call_cnt++; */
+	emit(A64_ADD_I(1, tcc, tcc, 1), ctx);
+
 	/* goto *(prog->bpf_func + prologue_offset); */
 	off = offsetof(struct bpf_prog, bpf_func);
 	emit_a64_mov_i64(tmp, off, ctx);
@@ -316,11 +376,11 @@ static int emit_bpf_tail_call(struct jit_ctx *ctx)
 	emit(A64_BR(tmp), ctx);
 
 	/* out: */
-	if (out_offset == -1)
-		out_offset = cur_offset;
-	if (cur_offset != out_offset) {
+	if (ctx->out_offset == -1)
+		ctx->out_offset = cur_offset;
+	if (cur_offset != ctx->out_offset) {
 		pr_err_once("tail_call out_offset = %d, expected %d!\n",
-			    cur_offset, out_offset);
+			    cur_offset, ctx->out_offset);
 		return -1;
 	}
 	return 0;
@@ -328,6 +388,121 @@ static int emit_bpf_tail_call(struct jit_ctx *ctx)
 #undef jmp_offset
 }
 
+/*
+ * Tail call with a constant key. The verifier has checked the index, and
+ * the B to the target's prologue is patched in and out of the poke slot
+ * as the map entry changes:
+ *
+ *   if (tail_call_cnt > MAX_TAIL_CALL_CNT)
+ *       goto out;
+ *   tail_call_cnt++;
+ *   sp += stack_size;
+ *   b prog->bpf_func + prologue_offset;	// NOP while the entry is empty
+ *   sp -= stack_size;
+ *   tail_call_cnt--;
+ * out:
+ */
+static void emit_bpf_tail_call_direct(struct bpf_jit_poke_descriptor *poke,
+				      struct jit_ctx *ctx)
+{
+	const u8 tcc = bpf2a64[TCALL_CNT];
+
+	emit(A64_CMP_I(1, tcc, MAX_TAIL_CALL_CNT), ctx);
+	emit(A64_B_(A64_COND_HI, 6), ctx);
+	emit(A64_ADD_I(1, tcc, tcc, 1), ctx);
+	emit(A64_ADD_I(1, A64_SP, A64_SP, ctx->stack_size), ctx);
+
+	if (ctx->image) {
+		poke->ip = ctx->image + ctx->idx;
+		poke->adj_off = sizeof(u32) * PROLOGUE_OFFSET;
+	}
+	emit(A64_NOP, ctx);
+
+	emit(A64_SUB_I(1, A64_SP, A64_SP, ctx->stack_size), ctx);
+	emit(A64_SUB_I(1, tcc, tcc, 1), ctx);
+	/* out: */
+}
+
+static u32 gen_branch_or_nop(void *ip, void *addr)
+{
+	if (!addr)
+		return aarch64_insn_gen_nop();
+	return aarch64_insn_gen_branch_imm((unsigned long)ip,
+					   (unsigned long)addr,
+					   AARCH64_INSN_BRANCH_NOLINK);
+}
+
+int bpf_arch_text_poke(void *ip, enum bpf_text_poke_type t,
+		       void *old_addr, void *new_addr)
+{
+	u32 old_insn, new_insn, replaced;
+	int ret;
+
+	/* Only the slots of direct tail calls are patched. */
+	if (t != BPF_MOD_JUMP)
+		return -ENOTSUPP;
+	if (!is_bpf_text_address((long)ip))
+		return -EINVAL;
+
+	old_insn = gen_branch_or_nop(ip, old_addr);
+	new_insn = gen_branch_or_nop(ip, new_addr);
+	if (old_insn == AARCH64_BREAK_FAULT || new_insn == AARCH64_BREAK_FAULT)
+		return -EFAULT;
+
+	mutex_lock(&text_mutex);
+	ret = aarch64_insn_read(ip, &replaced);
+	if (ret)
+		goto out;
+	ret = -EBUSY;
+	if (replaced != old_insn)
+		goto out;
+	/* A B and a NOP can be swapped without stopping the other CPUs. */
+	ret = 0;
+	if (old_insn != new_insn)
+		ret = aarch64_insn_patch_text_nosync(ip, new_insn);
+out:
+	mutex_unlock(&text_mutex);
+	return ret;
+}
+
+static void bpf_tail_call_direct_fixup(struct bpf_prog *prog)
+{
+	struct bpf_jit_poke_descriptor *poke;
+	struct bpf_array *array;
+	struct bpf_prog *target;
+	u32 insn;
+	int i;
+
+	for (i = 0; i < prog->aux->size_poke_tab; i++) {
+		poke = &prog->aux->poke_tab[i];
+		WARN_ON_ONCE(READ_ONCE(poke->ip_stable));
+
+		if (poke->reason != BPF_POKE_REASON_TAIL_CALL)
+			continue;
+
+		array = container_of(poke->tail_call.map, struct bpf_array, map);
+		mutex_lock(&array->aux->poke_mutex);
+		target = array->ptrs[poke->tail_call.key];
+		if (target) {
+			/*
+			 * The image is not live yet, so write the slot
+			 * directly. Once poke->ip_stable is set, further
+			 * updates go through bpf_arch_text_poke().
+			 */
+			insn = gen_branch_or_nop(poke->ip,
+						 (u8 *)target->bpf_func +
+						 poke->adj_off);
+			BUG_ON(insn == AARCH64_BREAK_FAULT);
+			*(__le32 *)poke->ip = cpu_to_le32(insn);
+			flush_icache_range((unsigned long)poke->ip,
+					   (unsigned long)poke->ip +
+					   AARCH64_INSN_SIZE);
+		}
+		WRITE_ONCE(poke->ip_stable, true);
+		mutex_unlock(&array->aux->poke_mutex);
+	}
+}
+
 static void build_epilogue(struct jit_ctx *ctx)
 {
 	const u8 r0 = bpf2a64[BPF_REG_0];
@@ -417,10 +592,210 @@ static int add_exception_handler(const struct bpf_insn *insn,
 	return 0;
 }
 
+/* Condition under which a conditional BPF jump is taken. */
+static u8 a64_jmp_cond(const u8 code)
+{
+	switch (BPF_OP(code)) {
+	case BPF_JEQ:
+		return A64_COND_EQ;
+	case BPF_JGT:
+		return A64_COND_HI;
+	case BPF_JLT:
+		return A64_COND_CC;
+	case BPF_JGE:
+		return A64_COND_CS;
+	case BPF_JLE:
+		return A64_COND_LS;
+	case BPF_JSET:
+	case BPF_JNE:
+		return A64_COND_NE;
+	case BPF_JSGT:
+		return A64_COND_GT;
+	case BPF_JSLT:
+		return A64_COND_LT;
+	case BPF_JSGE:
+		return A64_COND_GE;
+	case BPF_JSLE:
+		return A64_COND_LE;
+	default:
+		return A64_COND_AL;
+	}
+}
+
+/* Set the condition flags for a conditional BPF jump. */
+static void emit_a64_cmp(const struct bpf_insn *insn, struct jit_ctx *ctx)
+{
+	const u8 code = insn->code;
+	const u8 dst = bpf2a64[insn->dst_reg];
+	const u8 src = bpf2a64[insn->src_reg];
+	const u8 tmp = bpf2a64[TMP_REG_1];
+	const s32 imm = insn->imm;
+	const bool is64 = BPF_CLASS(code) == BPF_JMP;
+	u32 a64_insn;
+
+	if (BPF_SRC(code) == BPF_X) {
+		if (BPF_OP(code) == BPF_JSET)
+			emit(A64_TST(is64, dst, src), ctx);
+		else
+			emit(A64_CMP(is64, dst, src), ctx);
+	} else if (BPF_OP(code) == BPF_JSET) {
+		a64_insn = A64_TST_I(is64, dst, imm);
+		if (a64_insn != AARCH64_BREAK_FAULT) {
+			emit(a64_insn, ctx);
+		} else {
+			emit_a64_mov_i(is64, tmp, imm, ctx);
+			emit(A64_TST(is64, dst, tmp), ctx);
+		}
+	} else if (is_addsub_imm(imm)) {
+		emit(A64_CMP_I(is64, dst, imm), ctx);
+	} else if (is_addsub_imm(-imm)) {
+		emit(A64_CMN_I(is64, dst, -imm), ctx);
+	} else {
+		emit_a64_mov_i(is64, tmp, imm, ctx);
+		emit(A64_CMP(is64, dst, tmp), ctx);
+	}
+}
+
+/*
+ * A conditional jump over a single 64-bit MOV, ADD #1 or NEG can be done
+ * without branching: set the flags as for the jump, then keep the old
+ * value or compute the new one with CSEL, CSINC or CSNEG.
+ */
+static bool is_ifcvt(const struct bpf_insn *insn, const struct jit_ctx *ctx)
+{
+	const struct bpf_insn *next = insn + 1;
+	const int i = insn - ctx->prog->insnsi;
+
+	if (insn->off != 1)
+		return false;
+	if (i + 1 >= ctx->prog->len || test_bit(i + 1, ctx->jmp_targets))
+		return false;
+
+	switch (next->code) {
+	case BPF_ALU64 | BPF_MOV | BPF_X:
+	case BPF_ALU64 | BPF_MOV | BPF_K:
+	case BPF_ALU64 | BPF_NEG:
+		return true;
+	case BPF_ALU64 | BPF_ADD | BPF_K:
+		return next->imm == 1;
+	default:
+		return false;
+	}
+}
+
+static void emit_ifcvt(const struct bpf_insn *insn, struct jit_ctx *ctx)
+{
+	const struct bpf_insn *next = insn + 1;
+	const u8 rd = bpf2a64[next->dst_reg];
+	const u8 rm = bpf2a64[next->src_reg];
+	const u8 tmp2 = bpf2a64[TMP_REG_2];
+	const u8 cond = a64_jmp_cond(insn->code);
+
+	if (next->code == (BPF_ALU64 | BPF_MOV | BPF_K))
+		emit_a64_mov_i(1, tmp2, next->imm, ctx);
+	emit_a64_cmp(insn, ctx);
+
+	switch (next->code) {
+	case BPF_ALU64 | BPF_MOV | BPF_X:
+		emit(A64_CSEL(1, rd, rd, rm, cond), ctx);
+		break;
+	case BPF_ALU64 | BPF_MOV | BPF_K:
+		emit(A64_CSEL(1, rd, rd, tmp2, cond), ctx);
+		break;
+	case BPF_ALU64 | BPF_ADD | BPF_K:
+		emit(A64_CSINC(1, rd, rd, rd, cond), ctx);
+		break;
+	case BPF_ALU64 | BPF_NEG:
+		emit(A64_CSNEG(1, rd, rd, rd, cond), ctx);
+		break;
+	}
+}
+
+/*
+ * Two 64-bit loads or stores to adjacent BPF stack slots can be done with a
+ * single LDP or STP, unless the second one is a jump target.
+ */
+static bool is_ldst_pair(const struct bpf_insn *insn,
+			 const struct jit_ctx *ctx)
+{
+	const struct bpf_insn *next = insn + 1;
+	const int i = insn - ctx->prog->insnsi;
+
+	if (i + 1 >= ctx->prog->len || test_bit(i + 1, ctx->jmp_targets))
+		return false;
+	if (next->code != insn->code || next->off != insn->off + 8)
+		return false;
+	if (insn->off < -512 || insn->off > 504 || insn->off % 8)
+		return false;
+
+	switch (insn->code) {
+	case BPF_STX | BPF_MEM | BPF_DW:
+		return insn->dst_reg == BPF_REG_FP &&
+		       next->dst_reg == BPF_REG_FP;
+	case BPF_LDX | BPF_MEM | BPF_DW:
+		/* An LDP to the same register twice is unpredictable. */
+		return insn->src_reg == BPF_REG_FP &&
+		       next->src_reg == BPF_REG_FP &&
+		       insn->dst_reg != next->dst_reg;
+	default:
+		return false;
+	}
+}
+
+/*
+ * dst = dst / d or dst % d for a constant d != 0 without a divide: a shift
+ * or mask for powers of two, and the multiply-high sequence of
+ * bpf_jit_udiv_magic otherwise.
+ */
+static void emit_a64_udivmod_k(const u8 dst, const u64 d, const bool is64,
+			       const bool mod, struct jit_ctx *ctx)
+{
+	const u8 tmp = bpf2a64[TMP_REG_1];
+	const u8 tmp2 = bpf2a64[TMP_REG_2];
+	u32 a64_insn, shift;
+	u64 magic;
+
+	if (is_power_of_2(d)) {
+		if (!mod) {
+			emit(A64_LSR(is64, dst, dst, __ffs(d)), ctx);
+			return;
+		}
+		a64_insn = A64_AND_I(is64, dst, dst, d - 1);
+		if (a64_insn != AARCH64_BREAK_FAULT) {
+			emit(a64_insn, ctx);
+		} else {
+			/* d == 1: a zero mask is not a logical immediate. */
+			emit_a64_mov_i64(tmp, d - 1, ctx);
+			emit(A64_AND(is64, dst, dst, tmp), ctx);
+		}
+		return;
+	}
+
+	if (!is64)
+		emit(A64_MOV(0, dst, dst), ctx);
+
+	magic = bpf_jit_udiv_magic(d, &shift);
+	emit_a64_mov_i64(tmp, magic, ctx);
+	emit(A64_UMULH(tmp, dst, tmp), ctx);
+	emit(A64_SUB(1, tmp2, dst, tmp), ctx);
+	emit(A64_LSR(1, tmp2, tmp2, 1), ctx);
+	emit(A64_ADD(1, tmp2, tmp2, tmp), ctx);
+	emit(A64_LSR(1, tmp2, tmp2, shift), ctx);
+
+	if (!mod) {
+		emit(A64_MOV(is64, dst, tmp2), ctx);
+		return;
+	}
+
+	emit_a64_mov_i64(tmp, d, ctx);
+	emit(A64_MSUB(is64, dst, dst, tmp2, tmp), ctx);
+}
+
 /* JITs an eBPF instruction.
  * Returns:
  * 0  - successfully JITed an 8-byte eBPF instruction.
- * >0 - successfully JITed a 16-byte eBPF instruction.
+ * >0 - successfully JITed a 16-byte eBPF instruction, or two eBPF
+ *      instructions fused into one.
  * <0 - failed to JIT.
  */
 static int build_insn(const struct bpf_insn *insn, struct jit_ctx *ctx,
@@ -438,9 +813,10 @@ static int build_insn(const struct bpf_insn *insn, struct jit_ctx *ctx,
 	const bool is64 = BPF_CLASS(code) == BPF_ALU64 ||
 			  BPF_CLASS(code) == BPF_JMP;
 	const bool isdw = BPF_SIZE(code) == BPF_DW;
-	u8 jmp_cond, reg;
+	u8 reg;
 	s32 jmp_offset;
 	u32 a64_insn;
+	u64 mask;
 	int ret;
 
 #define check_imm(bits, imm) do {				\
@@ -451,6 +827,7 @@ static int build_insn(const struct bpf_insn *insn, struct jit_ctx *ctx,
 		return -EINVAL;					\
 	}							\
 } while (0)
+#define check_imm14(imm) check_imm(14, imm)
 #define check_imm19(imm) check_imm(19, imm)
 #define check_imm26(imm) check_imm(26, imm)
 
@@ -621,14 +998,10 @@ emit_bswap_uxt:
 		break;
 	case BPF_ALU | BPF_DIV | BPF_K:
 	case BPF_ALU64 | BPF_DIV | BPF_K:
-		emit_a64_mov_i(is64, tmp, imm, ctx);
-		emit(A64_UDIV(is64, dst, dst, tmp), ctx);
-		break;
 	case BPF_ALU | BPF_MOD | BPF_K:
 	case BPF_ALU64 | BPF_MOD | BPF_K:
-		emit_a64_mov_i(is64, tmp2, imm, ctx);
-		emit(A64_UDIV(is64, tmp, dst, tmp2), ctx);
-		emit(A64_MSUB(is64, dst, dst, tmp, tmp2), ctx);
+		emit_a64_udivmod_k(dst, is64 ? (u64)(s64)imm : (u32)imm, is64,
+				   BPF_OP(code) == BPF_MOD, ctx);
 		break;
 	case BPF_ALU | BPF_LSH | BPF_K:
 	case BPF_ALU64 | BPF_LSH | BPF_K:
@@ -660,6 +1033,7 @@ emit_bswap_uxt:
 	case BPF_JMP | BPF_JSLT | BPF_X:
 	case BPF_JMP | BPF_JSGE | BPF_X:
 	case BPF_JMP | BPF_JSLE | BPF_X:
+	case BPF_JMP | BPF_JSET | BPF_X:
 	case BPF_JMP32 | BPF_JEQ | BPF_X:
 	case BPF_JMP32 | BPF_JGT | BPF_X:
 	case BPF_JMP32 | BPF_JLT | BPF_X:
@@ -670,51 +1044,7 @@ emit_bswap_uxt:
 	case BPF_JMP32 | BPF_JSLT | BPF_X:
 	case BPF_JMP32 | BPF_JSGE | BPF_X:
 	case BPF_JMP32 | BPF_JSLE | BPF_X:
-		emit(A64_CMP(is64, dst, src), ctx);
-emit_cond_jmp:
-		jmp_offset = bpf2a64_offset(i, off, ctx);
-		check_imm19(jmp_offset);
-		switch (BPF_OP(code)) {
-		case BPF_JEQ:
-			jmp_cond = A64_COND_EQ;
-			break;
-		case BPF_JGT:
-			jmp_cond = A64_COND_HI;
-			break;
-		case BPF_JLT:
-			jmp_cond = A64_COND_CC;
-			break;
-		case BPF_JGE:
-			jmp_cond = A64_COND_CS;
-			break;
-		case BPF_JLE:
-			jmp_cond = A64_COND_LS;
-			break;
-		case BPF_JSET:
-		case BPF_JNE:
-			jmp_cond = A64_COND_NE;
-			break;
-		case BPF_JSGT:
-			jmp_cond = A64_COND_GT;
-			break;
-		case BPF_JSLT:
-			jmp_cond = A64_COND_LT;
-			break;
-		case BPF_JSGE:
-			jmp_cond = A64_COND_GE;
-			break;
-		case BPF_JSLE:
-			jmp_cond = A64_COND_LE;
-			break;
-		default:
-			return -EFAULT;
-		}
-		emit(A64_B_(jmp_cond, jmp_offset), ctx);
-		break;
-	case BPF_JMP | BPF_JSET | BPF_X:
 	case BPF_JMP32 | BPF_JSET | BPF_X:
-		emit(A64_TST(is64, dst, src), ctx);
-		goto emit_cond_jmp;
 	/* IF (dst COND imm) JUMP off */
 	case BPF_JMP | BPF_JEQ | BPF_K:
 	case BPF_JMP | BPF_JGT | BPF_K:
@@ -726,6 +1056,7 @@ emit_cond_jmp:
 	case BPF_JMP | BPF_JSLT | BPF_K:
 	case BPF_JMP | BPF_JSGE | BPF_K:
 	case BPF_JMP | BPF_JSLE | BPF_K:
+	case BPF_JMP | BPF_JSET | BPF_K:
 	case BPF_JMP32 | BPF_JEQ | BPF_K:
 	case BPF_JMP32 | BPF_JGT | BPF_K:
 	case BPF_JMP32 | BPF_JLT | BPF_K:
@@ -736,25 +1067,40 @@ emit_cond_jmp:
 	case BPF_JMP32 | BPF_JSLT | BPF_K:
 	case BPF_JMP32 | BPF_JSGE | BPF_K:
 	case BPF_JMP32 | BPF_JSLE | BPF_K:
-		if (is_addsub_imm(imm)) {
-			emit(A64_CMP_I(is64, dst, imm), ctx);
-		} else if (is_addsub_imm(-imm)) {
-			emit(A64_CMN_I(is64, dst, -imm), ctx);
-		} else {
-			emit_a64_mov_i(is64, tmp, imm, ctx);
-			emit(A64_CMP(is64, dst, tmp), ctx);
-		}
-		goto emit_cond_jmp;
-	case BPF_JMP | BPF_JSET | BPF_K:
 	case BPF_JMP32 | BPF_JSET | BPF_K:
-		a64_insn = A64_TST_I(is64, dst, imm);
-		if (a64_insn != AARCH64_BREAK_FAULT) {
-			emit(a64_insn, ctx);
-		} else {
-			emit_a64_mov_i(is64, tmp, imm, ctx);
-			emit(A64_TST(is64, dst, tmp), ctx);
+		if (is_ifcvt(insn, ctx)) {
+			emit_ifcvt(insn, ctx);
+			return 1;
+		}
+		if (BPF_SRC(code) == BPF_K && imm == 0 &&
+		    (BPF_OP(code) == BPF_JEQ || BPF_OP(code) == BPF_JNE)) {
+			jmp_offset = bpf2a64_offset(i, off, ctx);
+			check_imm19(jmp_offset);
+			if (BPF_OP(code) == BPF_JEQ)
+				emit(A64_CBZ(is64, dst, jmp_offset), ctx);
+			else
+				emit(A64_CBNZ(is64, dst, jmp_offset), ctx);
+			break;
 		}
-		goto emit_cond_jmp;
+		mask = is64 ? (u64)(s64)imm : (u32)imm;
+		if (BPF_SRC(code) == BPF_K && BPF_OP(code) == BPF_JSET &&
+		    ctx->use_tbz && is_power_of_2(mask)) {
+			jmp_offset = bpf2a64_offset(i, off, ctx);
+			/*
+			 * ctx->offset[] is not filled in during the fake
+			 * pass, so only check the range for real; the
+			 * use_tbz retry keeps it within 14 bits.
+			 */
+			if (ctx->image)
+				check_imm14(jmp_offset);
+			emit(A64_TBNZ(dst, __ffs(mask), jmp_offset), ctx);
+			break;
+		}
+		emit_a64_cmp(insn, ctx);
+		jmp_offset = bpf2a64_offset(i, off, ctx);
+		check_imm19(jmp_offset);
+		emit(A64_B_(a64_jmp_cond(code), jmp_offset), ctx);
+		break;
 	/* function call */
 	case BPF_JMP | BPF_CALL:
 	{
@@ -773,6 +1119,11 @@ emit_cond_jmp:
 	}
 	/* tail call */
 	case BPF_JMP | BPF_TAIL_CALL:
+		if (imm) {
+			emit_bpf_tail_call_direct(&ctx->prog->aux->poke_tab[imm - 1],
+						  ctx);
+			break;
+		}
 		if (emit_bpf_tail_call(ctx))
 			return -EFAULT;
 		break;
@@ -808,6 +1159,10 @@ emit_cond_jmp:
 	case BPF_LDX | BPF_PROBE_MEM | BPF_W:
 	case BPF_LDX | BPF_PROBE_MEM | BPF_H:
 	case BPF_LDX | BPF_PROBE_MEM | BPF_B:
+		if (is_ldst_pair(insn, ctx)) {
+			emit(A64_LDP(dst, bpf2a64[insn[1].dst_reg], src, off), ctx);
+			return 1;
+		}
 		emit_a64_mov_i(1, tmp, off, ctx);
 		switch (BPF_SIZE(code)) {
 		case BPF_W:
@@ -858,6 +1213,10 @@ emit_cond_jmp:
 	case BPF_STX | BPF_MEM | BPF_H:
 	case BPF_STX | BPF_MEM | BPF_B:
 	case BPF_STX | BPF_MEM | BPF_DW:
+		if (is_ldst_pair(insn, ctx)) {
+			emit(A64_STP(src, bpf2a64[insn[1].src_reg], dst, off), ctx);
+			return 1;
+		}
 		emit_a64_mov_i(1, tmp, off, ctx);
 		switch (BPF_SIZE(code)) {
 		case BPF_W:
@@ -1020,6 +1379,7 @@ struct bpf_prog *bpf_int_jit_compile(struct bpf_prog *prog)
 	}
 	memset(&ctx, 0, sizeof(ctx));
 	ctx.prog = prog;
+	ctx.out_offset = -1;
 
 	ctx.offset = kcalloc(prog->len + 1, sizeof(int), GFP_KERNEL);
 	if (ctx.offset == NULL) {
@@ -1027,7 +1387,22 @@ struct bpf_prog *bpf_int_jit_compile(struct bpf_prog *prog)
 		goto out_off;
 	}
 
-	/* 1. Initial fake pass to compute ctx->idx. */
+	ctx.jmp_targets = bitmap_zalloc(prog->len, GFP_KERNEL);
+	if (ctx.jmp_targets == NULL) {
+		prog = orig_prog;
+		goto out_off;
+	}
+	bpf_jit_mark_jmp_targets(prog->insnsi, prog->len, ctx.jmp_targets);
+
+	/*
+	 * 1. Initial fake pass to compute ctx->idx.
+	 *
+	 * TBZ/TBNZ only reach +/-32KB. Assume the program is small enough
+	 * for every branch to be in range, and redo the pass without them
+	 * if it turns out not to be.
+	 */
+	ctx.use_tbz = true;
+retry_fake_pass:
 
 	/* Fake pass to fill in ctx->offset. */
 	if (build_body(&ctx, extra_pass)) {
@@ -1043,6 +1418,12 @@ struct bpf_prog *bpf_int_jit_compile(struct bpf_prog *prog)
 	ctx.epilogue_offset = ctx.idx;
 	build_epilogue(&ctx);
 
+	if (ctx.use_tbz && ctx.idx >= SZ_32K / AARCH64_INSN_SIZE) {
+		ctx.use_tbz = false;
+		ctx.idx = 0;
+		goto retry_fake_pass;
+	}
+
 	extable_size = prog->aux->num_exentries *
 		sizeof(struct exception_table_entry);
 
@@ -1097,6 +1478,7 @@ skip_init_ctx:
 			prog->jited = 0;
 			goto out_off;
 		}
+		bpf_tail_call_direct_fixup(prog);
 		bpf_jit_binary_lock_ro(header);
 	} else {
 		jit_data->ctx = ctx;
@@ -1111,6 +1493,7 @@ skip_init_ctx:
 		bpf_prog_fill_jited_linfo(prog, ctx.offset + 1);
 out_off:
 		kfree(ctx.offset);
+		bitmap_free(ctx.jmp_targets);
 		kfree(jit_data);
 		prog->aux->jit_data = NULL;
 	}
@@ -73,6 +73,13 @@ struct rv_jit_context {
 	int *offset;		/* BPF to RV */
 	unsigned long flags;
 	int stack_size;
+	int nexentries;	/* exception table entries emitted */
+	int frame_start;	/* BPF insn that sets up the stack frame */
+	unsigned long *jmp_targets;	/* BPF insns that are jump targets */
+	int reg_cache;	/* RV32: stacked BPF reg held in TMP_REG_1 */
+	u16 hi_zero;	/* RV32: BPF regs whose upper half is zero */
+	bool dst_hi_zero;	/* RV32: current insn dst was in hi_zero */
+	bool src_hi_zero;	/* RV32: current insn src or imm has zero upper half */
 };
 
 /* Convert from ninsns to bytes. */
@@ -119,6 +126,11 @@ static inline void emitc(const u16 insn, struct rv_jit_context *ctx)
 	ctx->ninsns++;
 }
 
+static inline bool bpf_jit_is_jmp_target(struct rv_jit_context *ctx, int insn)
+{
+	return test_bit(insn, ctx->jmp_targets);
+}
+
 static inline int epilogue_offset(struct rv_jit_context *ctx)
 {
 	int to = ctx->epilogue_offset, from = ctx->ninsns;
@@ -169,6 +181,11 @@ static inline bool is_8b_uint(unsigned long val)
 	return val < (1UL << 8);
 }
 
+static inline bool is_9b_int(long val)
+{
+	return -(1L << 8) <= val && val < (1L << 8);
+}
+
 static inline bool is_9b_uint(unsigned long val)
 {
 	return val < (1UL << 9);
@@ -663,6 +680,35 @@ static inline u16 rvc_swsp(u32 imm8, u8 rs2)
 	return rv_css_insn(0x6, imm, rs2, 0x2);
 }
 
+static inline u16 rvc_beqz(u8 rs1, u32 imm9)
+{
+	u32 imm;
+
+	imm = ((imm9 & 0x100) >> 3) | ((imm9 & 0xc0) >> 3) | (imm9 & 0x6) |
+	      ((imm9 & 0x20) >> 5);
+	return rv_cb_insn(0x6, imm, (imm9 & 0x18) >> 3, rs1, 0x1);
+}
+
+static inline u16 rvc_bnez(u8 rs1, u32 imm9)
+{
+	u32 imm;
+
+	imm = ((imm9 & 0x100) >> 3) | ((imm9 & 0xc0) >> 3) | (imm9 & 0x6) |
+	      ((imm9 & 0x20) >> 5);
+	return rv_cb_insn(0x7, imm, (imm9 & 0x18) >> 3, rs1, 0x1);
+}
+
+static inline u16 rvc_j(u32 imm12)
+{
+	u32 imm;
+
+	imm = ((imm12 & 0x800) >> 1) | ((imm12 & 0x10) << 5) |
+	      ((imm12 & 0x300) >> 1) | ((imm12 & 0x400) >> 4) |
+	      ((imm12 & 0x40) >> 1) | ((imm12 & 0x80) >> 3) |
+	      (imm12 & 0xe) | ((imm12 & 0x20) >> 5);
+	return (0x5 << 13) | (imm << 2) | 0x1;
+}
+
 /*
  * RV64-only instructions.
  *
@@ -812,6 +858,24 @@ static inline void emit_jalr(u8 rd, u8 rs, s32 imm, struct rv_jit_context *ctx)
 		emit(rv_jalr(rd, rs, imm), ctx);
 }
 
+static inline void emit_beq(u8 rs1, u8 rs2, s32 rvoff,
+			    struct rv_jit_context *ctx)
+{
+	if (rvc_enabled() && !rs2 && is_creg(rs1) && is_9b_int(rvoff))
+		emitc(rvc_beqz(rs1, rvoff), ctx);
+	else
+		emit(rv_beq(rs1, rs2, rvoff >> 1), ctx);
+}
+
+static inline void emit_bne(u8 rs1, u8 rs2, s32 rvoff,
+			    struct rv_jit_context *ctx)
+{
+	if (rvc_enabled() && !rs2 && is_creg(rs1) && is_9b_int(rvoff))
+		emitc(rvc_bnez(rs1, rvoff), ctx);
+	else
+		emit(rv_bne(rs1, rs2, rvoff >> 1), ctx);
+}
+
 static inline void emit_mv(u8 rd, u8 rs, struct rv_jit_context *ctx)
 {
 	if (rvc_enabled() && rd && rs)
@@ -982,6 +1046,7 @@ static inline void emit_subw(u8 rd, u8 rs1, u8 rs2, struct rv_jit_context *ctx)
 
 #endif /* __riscv_xlen == 64 */
 
+int bpf_jit_frame_start(struct rv_jit_context *ctx);
 void bpf_jit_build_prologue(struct rv_jit_context *ctx);
 void bpf_jit_build_epilogue(struct rv_jit_context *ctx);
 
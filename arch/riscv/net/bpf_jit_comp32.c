@@ -11,6 +11,7 @@
 
 #include <linux/bpf.h>
 #include <linux/filter.h>
+#include <linux/math64.h>
 #include "bpf_jit.h"
 
 /*
@@ -182,12 +183,46 @@ static bool is_stacked(s8 reg)
 	return reg < 0;
 }
 
+/*
+ * TMP_REG_1 keeps a copy of the stacked BPF register it was last loaded
+ * from or stored to, recorded in ctx->reg_cache; the stack slots remain
+ * up to date, so the copy can be reused without being written back.
+ */
+static bool is_cached(const s8 *reg, const s8 *tmp,
+		      struct rv_jit_context *ctx)
+{
+	return tmp == bpf2rv32[TMP_REG_1] && ctx->reg_cache == hi(reg);
+}
+
+/*
+ * The upper half of dst must be cleared, unless the verifier inserts zext
+ * instructions or it is known to be zero already.
+ */
+static bool need_zext(struct rv_jit_context *ctx)
+{
+	return !ctx->prog->aux->verifier_zext && !ctx->dst_hi_zero;
+}
+
+/*
+ * ALU64 MOV/AND/OR/XOR keep the upper half of dst zero if both operands
+ * have zero upper halves, so only the lower halves need to be computed.
+ */
+static bool alu64_lo32_only(struct rv_jit_context *ctx, u8 op)
+{
+	return ctx->dst_hi_zero && ctx->src_hi_zero &&
+	       (op == BPF_MOV || op == BPF_AND || op == BPF_OR || op == BPF_XOR);
+}
+
 static const s8 *bpf_get_reg64(const s8 *reg, const s8 *tmp,
 			       struct rv_jit_context *ctx)
 {
 	if (is_stacked(hi(reg))) {
-		emit(rv_lw(hi(tmp), hi(reg), RV_REG_FP), ctx);
-		emit(rv_lw(lo(tmp), lo(reg), RV_REG_FP), ctx);
+		if (!is_cached(reg, tmp, ctx)) {
+			emit(rv_lw(hi(tmp), hi(reg), RV_REG_FP), ctx);
+			emit(rv_lw(lo(tmp), lo(reg), RV_REG_FP), ctx);
+			if (tmp == bpf2rv32[TMP_REG_1])
+				ctx->reg_cache = hi(reg);
+		}
 		reg = tmp;
 	}
 	return reg;
@@ -199,6 +234,8 @@ static void bpf_put_reg64(const s8 *reg, const s8 *src,
 	if (is_stacked(hi(reg))) {
 		emit(rv_sw(RV_REG_FP, hi(reg), hi(src)), ctx);
 		emit(rv_sw(RV_REG_FP, lo(reg), lo(src)), ctx);
+		if (src == bpf2rv32[TMP_REG_1])
+			ctx->reg_cache = hi(reg);
 	}
 }
 
@@ -206,20 +243,36 @@ static const s8 *bpf_get_reg32(const s8 *reg, const s8 *tmp,
 			       struct rv_jit_context *ctx)
 {
 	if (is_stacked(lo(reg))) {
-		emit(rv_lw(lo(tmp), lo(reg), RV_REG_FP), ctx);
+		if (!is_cached(reg, tmp, ctx)) {
+			emit(rv_lw(lo(tmp), lo(reg), RV_REG_FP), ctx);
+			if (tmp == bpf2rv32[TMP_REG_1])
+				ctx->reg_cache = 0;
+		}
 		reg = tmp;
 	}
 	return reg;
 }
 
+/* Only the lower half of the source is read if the upper half is zero. */
+static const s8 *bpf_get_src64(const s8 *reg, const s8 *tmp,
+			       struct rv_jit_context *ctx)
+{
+	if (ctx->src_hi_zero)
+		reg = bpf_get_reg32(reg, tmp, ctx);
+	else
+		reg = bpf_get_reg64(reg, tmp, ctx);
+	return reg;
+}
+
 static void bpf_put_reg32(const s8 *reg, const s8 *src,
 			  struct rv_jit_context *ctx)
 {
 	if (is_stacked(lo(reg))) {
 		emit(rv_sw(RV_REG_FP, lo(reg), lo(src)), ctx);
-		if (!ctx->prog->aux->verifier_zext)
+		if (need_zext(ctx))
 			emit(rv_sw(RV_REG_FP, hi(reg), RV_REG_ZERO), ctx);
-	} else if (!ctx->prog->aux->verifier_zext) {
+		ctx->reg_cache = 0;
+	} else if (need_zext(ctx)) {
 		emit(rv_addi(hi(reg), RV_REG_ZERO, 0), ctx);
 	}
 }
@@ -296,7 +349,8 @@ static void emit_alu_i64(const s8 *dst, s32 imm,
 	case BPF_RSH:
 		if (imm >= 32) {
 			emit(rv_srli(lo(rd), hi(rd), imm - 32), ctx);
-			emit(rv_addi(hi(rd), RV_REG_ZERO, 0), ctx);
+			if (!ctx->dst_hi_zero)
+				emit(rv_addi(hi(rd), RV_REG_ZERO, 0), ctx);
 		} else if (imm == 0) {
 			/* Do nothing. */
 		} else {
@@ -403,18 +457,22 @@ static void emit_alu_i32(const s8 *dst, s32 imm,
 	bpf_put_reg32(dst, rd, ctx);
 }
 
+/* If the upper half of src is zero, it is neither loaded nor used. */
 static void emit_alu_r64(const s8 *dst, const s8 *src,
 			 struct rv_jit_context *ctx, const u8 op)
 {
 	const s8 *tmp1 = bpf2rv32[TMP_REG_1];
 	const s8 *tmp2 = bpf2rv32[TMP_REG_2];
 	const s8 *rd = bpf_get_reg64(dst, tmp1, ctx);
-	const s8 *rs = bpf_get_reg64(src, tmp2, ctx);
+	const s8 *rs = bpf_get_src64(src, tmp2, ctx);
 
 	switch (op) {
 	case BPF_MOV:
 		emit(rv_addi(lo(rd), lo(rs), 0), ctx);
-		emit(rv_addi(hi(rd), hi(rs), 0), ctx);
+		if (ctx->src_hi_zero)
+			emit(rv_addi(hi(rd), RV_REG_ZERO, 0), ctx);
+		else
+			emit(rv_addi(hi(rd), hi(rs), 0), ctx);
 		break;
 	case BPF_ADD:
 		if (rd == rs) {
@@ -422,6 +480,10 @@ static void emit_alu_r64(const s8 *dst, const s8 *src,
 			emit(rv_slli(hi(rd), hi(rd), 1), ctx);
 			emit(rv_or(hi(rd), RV_REG_T0, hi(rd)), ctx);
 			emit(rv_slli(lo(rd), lo(rd), 1), ctx);
+		} else if (ctx->src_hi_zero) {
+			emit(rv_add(lo(rd), lo(rd), lo(rs)), ctx);
+			emit(rv_sltu(RV_REG_T0, lo(rd), lo(rs)), ctx);
+			emit(rv_add(hi(rd), hi(rd), RV_REG_T0), ctx);
 		} else {
 			emit(rv_add(lo(rd), lo(rd), lo(rs)), ctx);
 			emit(rv_sltu(RV_REG_T0, lo(rd), lo(rs)), ctx);
@@ -430,30 +492,48 @@ static void emit_alu_r64(const s8 *dst, const s8 *src,
 		}
 		break;
 	case BPF_SUB:
-		emit(rv_sub(RV_REG_T1, hi(rd), hi(rs)), ctx);
-		emit(rv_sltu(RV_REG_T0, lo(rd), lo(rs)), ctx);
-		emit(rv_sub(hi(rd), RV_REG_T1, RV_REG_T0), ctx);
-		emit(rv_sub(lo(rd), lo(rd), lo(rs)), ctx);
+		if (ctx->src_hi_zero) {
+			emit(rv_sltu(RV_REG_T0, lo(rd), lo(rs)), ctx);
+			emit(rv_sub(hi(rd), hi(rd), RV_REG_T0), ctx);
+			emit(rv_sub(lo(rd), lo(rd), lo(rs)), ctx);
+		} else {
+			emit(rv_sub(RV_REG_T1, hi(rd), hi(rs)), ctx);
+			emit(rv_sltu(RV_REG_T0, lo(rd), lo(rs)), ctx);
+			emit(rv_sub(hi(rd), RV_REG_T1, RV_REG_T0), ctx);
+			emit(rv_sub(lo(rd), lo(rd), lo(rs)), ctx);
+		}
 		break;
 	case BPF_AND:
 		emit(rv_and(lo(rd), lo(rd), lo(rs)), ctx);
-		emit(rv_and(hi(rd), hi(rd), hi(rs)), ctx);
+		if (ctx->src_hi_zero)
+			emit(rv_addi(hi(rd), RV_REG_ZERO, 0), ctx);
+		else
+			emit(rv_and(hi(rd), hi(rd), hi(rs)), ctx);
 		break;
 	case BPF_OR:
 		emit(rv_or(lo(rd), lo(rd), lo(rs)), ctx);
-		emit(rv_or(hi(rd), hi(rd), hi(rs)), ctx);
+		if (!ctx->src_hi_zero)
+			emit(rv_or(hi(rd), hi(rd), hi(rs)), ctx);
 		break;
 	case BPF_XOR:
 		emit(rv_xor(lo(rd), lo(rd), lo(rs)), ctx);
-		emit(rv_xor(hi(rd), hi(rd), hi(rs)), ctx);
+		if (!ctx->src_hi_zero)
+			emit(rv_xor(hi(rd), hi(rd), hi(rs)), ctx);
 		break;
 	case BPF_MUL:
-		emit(rv_mul(RV_REG_T0, hi(rs), lo(rd)), ctx);
-		emit(rv_mul(hi(rd), hi(rd), lo(rs)), ctx);
-		emit(rv_mulhu(RV_REG_T1, lo(rd), lo(rs)), ctx);
-		emit(rv_add(hi(rd), hi(rd), RV_REG_T0), ctx);
-		emit(rv_mul(lo(rd), lo(rd), lo(rs)), ctx);
-		emit(rv_add(hi(rd), hi(rd), RV_REG_T1), ctx);
+		if (ctx->src_hi_zero) {
+			emit(rv_mul(hi(rd), hi(rd), lo(rs)), ctx);
+			emit(rv_mulhu(RV_REG_T1, lo(rd), lo(rs)), ctx);
+			emit(rv_mul(lo(rd), lo(rd), lo(rs)), ctx);
+			emit(rv_add(hi(rd), hi(rd), RV_REG_T1), ctx);
+		} else {
+			emit(rv_mul(RV_REG_T0, hi(rs), lo(rd)), ctx);
+			emit(rv_mul(hi(rd), hi(rd), lo(rs)), ctx);
+			emit(rv_mulhu(RV_REG_T1, lo(rd), lo(rs)), ctx);
+			emit(rv_add(hi(rd), hi(rd), RV_REG_T0), ctx);
+			emit(rv_mul(lo(rd), lo(rd), lo(rs)), ctx);
+			emit(rv_add(hi(rd), hi(rd), RV_REG_T1), ctx);
+		}
 		break;
 	case BPF_LSH:
 		emit(rv_addi(RV_REG_T0, lo(rs), -32), ctx);
@@ -769,6 +849,74 @@ static void emit_call(bool fixed, u64 addr, struct rv_jit_context *ctx)
 	emit(rv_addi(lo(r0), RV_REG_A0, 0), ctx);
 	emit(rv_addi(hi(r0), RV_REG_A1, 0), ctx);
 	emit(rv_addi(RV_REG_SP, RV_REG_SP, 16), ctx);
+
+	/* TMP_REG_1 is caller-saved. */
+	ctx->reg_cache = 0;
+}
+
+static void emit_divmod64(const s8 *dst, const s8 *src,
+			  struct rv_jit_context *ctx, const u8 op)
+{
+	const s8 *tmp1 = bpf2rv32[TMP_REG_1];
+	const s8 *tmp2 = bpf2rv32[TMP_REG_2];
+	const s8 *rd = bpf_get_reg64(dst, tmp1, ctx);
+	const s8 *rs = bpf_get_reg64(src, tmp2, ctx);
+	u32 addr = (u32)(unsigned long)(op == BPF_DIV ?
+					bpf_jit_udiv64 : bpf_jit_mod64);
+	u32 upper = (addr + (1 << 11)) >> 12;
+	u32 lower = addr & 0xfff;
+
+	/* Save R1-R4, which live in caller-saved registers. */
+	emit(rv_addi(RV_REG_SP, RV_REG_SP, -32), ctx);
+	emit(rv_sw(RV_REG_SP, 0, RV_REG_A0), ctx);
+	emit(rv_sw(RV_REG_SP, 4, RV_REG_A1), ctx);
+	emit(rv_sw(RV_REG_SP, 8, RV_REG_A2), ctx);
+	emit(rv_sw(RV_REG_SP, 12, RV_REG_A3), ctx);
+	emit(rv_sw(RV_REG_SP, 16, RV_REG_A4), ctx);
+	emit(rv_sw(RV_REG_SP, 20, RV_REG_A5), ctx);
+	emit(rv_sw(RV_REG_SP, 24, RV_REG_A6), ctx);
+	emit(rv_sw(RV_REG_SP, 28, RV_REG_A7), ctx);
+
+	/*
+	 * Pass the dividend in a0-a1 and the divisor in a2-a3. Either may
+	 * be held in those registers already, so go through t0-t1.
+	 */
+	emit(rv_addi(RV_REG_T0, lo(rd), 0), ctx);
+	emit(rv_addi(RV_REG_T1, hi(rd), 0), ctx);
+	emit(rv_addi(RV_REG_A2, lo(rs), 0), ctx);
+	emit(rv_addi(RV_REG_A3, hi(rs), 0), ctx);
+	emit(rv_addi(RV_REG_A0, RV_REG_T0, 0), ctx);
+	emit(rv_addi(RV_REG_A1, RV_REG_T1, 0), ctx);
+
+	/* Backup TCC. */
+	emit(rv_addi(RV_REG_TCC_SAVED, RV_REG_TCC, 0), ctx);
+
+	emit(rv_lui(RV_REG_T1, upper), ctx);
+	emit(rv_jalr(RV_REG_RA, RV_REG_T1, lower), ctx);
+
+	/* Restore TCC. */
+	emit(rv_addi(RV_REG_TCC, RV_REG_TCC_SAVED, 0), ctx);
+
+	/* Keep the result in TMP_REG_1 while restoring R1-R4. */
+	emit(rv_addi(lo(tmp1), RV_REG_A0, 0), ctx);
+	emit(rv_addi(hi(tmp1), RV_REG_A1, 0), ctx);
+	emit(rv_lw(RV_REG_A0, 0, RV_REG_SP), ctx);
+	emit(rv_lw(RV_REG_A1, 4, RV_REG_SP), ctx);
+	emit(rv_lw(RV_REG_A2, 8, RV_REG_SP), ctx);
+	emit(rv_lw(RV_REG_A3, 12, RV_REG_SP), ctx);
+	emit(rv_lw(RV_REG_A4, 16, RV_REG_SP), ctx);
+	emit(rv_lw(RV_REG_A5, 20, RV_REG_SP), ctx);
+	emit(rv_lw(RV_REG_A6, 24, RV_REG_SP), ctx);
+	emit(rv_lw(RV_REG_A7, 28, RV_REG_SP), ctx);
+	emit(rv_addi(RV_REG_SP, RV_REG_SP, 32), ctx);
+	ctx->reg_cache = 0;
+
+	if (is_stacked(hi(dst))) {
+		bpf_put_reg64(dst, tmp1, ctx);
+	} else {
+		emit(rv_addi(lo(dst), lo(tmp1), 0), ctx);
+		emit(rv_addi(hi(dst), hi(tmp1), 0), ctx);
+	}
 }
 
 static int emit_bpf_tail_call(int insn, struct rv_jit_context *ctx)
@@ -849,17 +997,17 @@ static int emit_load_r64(const s8 *dst, const s8 *src, s16 off,
 	switch (size) {
 	case BPF_B:
 		emit(rv_lbu(lo(rd), 0, RV_REG_T0), ctx);
-		if (!ctx->prog->aux->verifier_zext)
+		if (need_zext(ctx))
 			emit(rv_addi(hi(rd), RV_REG_ZERO, 0), ctx);
 		break;
 	case BPF_H:
 		emit(rv_lhu(lo(rd), 0, RV_REG_T0), ctx);
-		if (!ctx->prog->aux->verifier_zext)
+		if (need_zext(ctx))
 			emit(rv_addi(hi(rd), RV_REG_ZERO, 0), ctx);
 		break;
 	case BPF_W:
 		emit(rv_lw(lo(rd), 0, RV_REG_T0), ctx);
-		if (!ctx->prog->aux->verifier_zext)
+		if (need_zext(ctx))
 			emit(rv_addi(hi(rd), RV_REG_ZERO, 0), ctx);
 		break;
 	case BPF_DW:
@@ -881,9 +1029,6 @@ static int emit_store_r64(const s8 *dst, const s8 *src, s16 off,
 	const s8 *rd = bpf_get_reg64(dst, tmp1, ctx);
 	const s8 *rs = bpf_get_reg64(src, tmp2, ctx);
 
-	if (mode == BPF_XADD && size != BPF_W)
-		return -1;
-
 	emit_imm(RV_REG_T0, off, ctx);
 	emit(rv_add(RV_REG_T0, RV_REG_T0, lo(rd)), ctx);
 
@@ -906,8 +1051,26 @@ static int emit_store_r64(const s8 *dst, const s8 *src, s16 off,
 		}
 		break;
 	case BPF_DW:
-		emit(rv_sw(RV_REG_T0, 0, lo(rs)), ctx);
-		emit(rv_sw(RV_REG_T0, 4, hi(rs)), ctx);
+		switch (mode) {
+		case BPF_MEM:
+			emit(rv_sw(RV_REG_T0, 0, lo(rs)), ctx);
+			emit(rv_sw(RV_REG_T0, 4, hi(rs)), ctx);
+			break;
+		case BPF_XADD:
+			/*
+			 * No 8-byte atomics in RV32: add to the low word, then
+			 * add the high word and the carry out of the low word.
+			 */
+			emit(rv_amoadd_w(RV_REG_T1, lo(rs), RV_REG_T0, 0, 0),
+			     ctx);
+			emit(rv_add(RV_REG_T1, RV_REG_T1, lo(rs)), ctx);
+			emit(rv_sltu(RV_REG_T1, RV_REG_T1, lo(rs)), ctx);
+			emit(rv_add(RV_REG_T1, RV_REG_T1, hi(rs)), ctx);
+			emit(rv_addi(RV_REG_T0, RV_REG_T0, 4), ctx);
+			emit(rv_amoadd_w(RV_REG_ZERO, RV_REG_T1, RV_REG_T0, 0, 0),
+			     ctx);
+			break;
+		}
 		break;
 	}
 
@@ -968,6 +1131,20 @@ int bpf_jit_emit_insn(const struct bpf_insn *insn, struct rv_jit_context *ctx,
 	const s8 *tmp1 = bpf2rv32[TMP_REG_1];
 	const s8 *tmp2 = bpf2rv32[TMP_REG_2];
 
+	/*
+	 * Control may reach a jump target with anything in TMP_REG_1 and in
+	 * the upper halves of BPF registers.
+	 */
+	if (!i || bpf_jit_is_jmp_target(ctx, i)) {
+		ctx->reg_cache = 0;
+		ctx->hi_zero = 0;
+	}
+	ctx->dst_hi_zero = ctx->hi_zero & BIT(insn->dst_reg);
+	ctx->src_hi_zero = BPF_SRC(code) == BPF_K ? imm >= 0 :
+			   ctx->hi_zero & BIT(insn->src_reg);
+	ctx->hi_zero = bpf_jit_hi_zero_next(insn, ctx->hi_zero,
+					    ctx->prog->aux->verifier_zext);
+
 	switch (code) {
 	case BPF_ALU64 | BPF_MOV | BPF_X:
 
@@ -987,8 +1164,15 @@ int bpf_jit_emit_insn(const struct bpf_insn *insn, struct rv_jit_context *ctx,
 	case BPF_ALU64 | BPF_LSH | BPF_X:
 	case BPF_ALU64 | BPF_RSH | BPF_X:
 	case BPF_ALU64 | BPF_ARSH | BPF_X:
+		if (alu64_lo32_only(ctx, BPF_OP(code))) {
+			emit_alu_r32(dst, src, ctx, BPF_OP(code));
+			break;
+		}
 		if (BPF_SRC(code) == BPF_K) {
-			emit_imm32(tmp2, imm, ctx);
+			if (ctx->src_hi_zero)
+				emit_imm(lo(tmp2), imm, ctx);
+			else
+				emit_imm32(tmp2, imm, ctx);
 			src = tmp2;
 		}
 		emit_alu_r64(dst, src, ctx, BPF_OP(code));
@@ -1002,7 +1186,12 @@ int bpf_jit_emit_insn(const struct bpf_insn *insn, struct rv_jit_context *ctx,
 	case BPF_ALU64 | BPF_DIV | BPF_K:
 	case BPF_ALU64 | BPF_MOD | BPF_X:
 	case BPF_ALU64 | BPF_MOD | BPF_K:
-		goto notsupported;
+		if (BPF_SRC(code) == BPF_K) {
+			emit_imm32(tmp2, imm, ctx);
+			src = tmp2;
+		}
+		emit_divmod64(dst, src, ctx, BPF_OP(code));
+		break;
 
 	case BPF_ALU64 | BPF_MOV | BPF_K:
 	case BPF_ALU64 | BPF_AND | BPF_K:
@@ -1011,13 +1200,17 @@ int bpf_jit_emit_insn(const struct bpf_insn *insn, struct rv_jit_context *ctx,
 	case BPF_ALU64 | BPF_LSH | BPF_K:
 	case BPF_ALU64 | BPF_RSH | BPF_K:
 	case BPF_ALU64 | BPF_ARSH | BPF_K:
-		emit_alu_i64(dst, imm, ctx, BPF_OP(code));
+		if (alu64_lo32_only(ctx, BPF_OP(code)))
+			emit_alu_i32(dst, imm, ctx, BPF_OP(code));
+		else
+			emit_alu_i64(dst, imm, ctx, BPF_OP(code));
 		break;
 
 	case BPF_ALU | BPF_MOV | BPF_X:
 		if (imm == 1) {
 			/* Special mov32 for zext. */
-			emit_zext64(dst, ctx);
+			if (!ctx->dst_hi_zero)
+				emit_zext64(dst, ctx);
 			break;
 		}
 		/* Fallthrough. */
@@ -1081,7 +1274,7 @@ int bpf_jit_emit_insn(const struct bpf_insn *insn, struct rv_jit_context *ctx,
 			emit(rv_srli(lo(rd), lo(rd), 16), ctx);
 			/* Fallthrough. */
 		case 32:
-			if (!ctx->prog->aux->verifier_zext)
+			if (need_zext(ctx))
 				emit(rv_addi(hi(rd), RV_REG_ZERO, 0), ctx);
 			break;
 		case 64:
@@ -1103,12 +1296,12 @@ int bpf_jit_emit_insn(const struct bpf_insn *insn, struct rv_jit_context *ctx,
 		switch (imm) {
 		case 16:
 			emit_rev16(lo(rd), ctx);
-			if (!ctx->prog->aux->verifier_zext)
+			if (need_zext(ctx))
 				emit(rv_addi(hi(rd), RV_REG_ZERO, 0), ctx);
 			break;
 		case 32:
 			emit_rev32(lo(rd), ctx);
-			if (!ctx->prog->aux->verifier_zext)
+			if (need_zext(ctx))
 				emit(rv_addi(hi(rd), RV_REG_ZERO, 0), ctx);
 			break;
 		case 64:
@@ -1261,6 +1454,7 @@ int bpf_jit_emit_insn(const struct bpf_insn *insn, struct rv_jit_context *ctx,
 	case BPF_STX | BPF_MEM | BPF_W:
 	case BPF_STX | BPF_MEM | BPF_DW:
 	case BPF_STX | BPF_XADD | BPF_W:
+	case BPF_STX | BPF_XADD | BPF_DW:
 		if (BPF_CLASS(code) == BPF_ST) {
 			emit_imm32(tmp2, imm, ctx);
 			src = tmp2;
@@ -1271,14 +1465,6 @@ int bpf_jit_emit_insn(const struct bpf_insn *insn, struct rv_jit_context *ctx,
 			return -1;
 		break;
 
-	/* No hardware support for 8-byte atomics in RV32. */
-	case BPF_STX | BPF_XADD | BPF_DW:
-		/* Fallthrough. */
-
-notsupported:
-		pr_info_once("bpf-jit: not supported: opcode %02x ***\n", code);
-		return -EFAULT;
-
 	default:
 		pr_err("bpf-jit: unknown opcode %02x\n", code);
 		return -EINVAL;
@@ -7,6 +7,7 @@
 
 #include <linux/bpf.h>
 #include <linux/filter.h>
+#include <asm/extable.h>
 #include "bpf_jit.h"
 
 #define RV_REG_TCC RV_REG_A6
@@ -163,9 +164,27 @@ static void emit_imm(u8 rd, s64 val, struct rv_jit_context *ctx)
 		emit_addi(rd, rd, lower, ctx);
 }
 
+/* Part of the frame allocated before saving callee-saved registers. These
+ * sit at the top of the frame, above the BPF stack, which is allocated in a
+ * separate step when it would put them out of reach of c.sdsp/c.ldsp.
+ */
+static int save_area_adjust(int stack_adjust, struct rv_jit_context *ctx)
+{
+	int bpf_stack_adjust = round_up(ctx->prog->aux->stack_depth, 16);
+
+	if (rvc_enabled() && !is_9b_uint(stack_adjust - 8))
+		return stack_adjust - bpf_stack_adjust;
+	return stack_adjust;
+}
+
 static void __build_epilogue(bool is_tail_call, struct rv_jit_context *ctx)
 {
-	int stack_adjust = ctx->stack_size, store_offset = stack_adjust - 8;
+	int stack_adjust = ctx->stack_size;
+	int sp_adjust = save_area_adjust(stack_adjust, ctx);
+	int store_offset = sp_adjust - 8;
+
+	if (sp_adjust != stack_adjust)
+		emit_addi(RV_REG_SP, RV_REG_SP, stack_adjust - sp_adjust, ctx);
 
 	if (seen_reg(RV_REG_RA, ctx)) {
 		emit_ld(RV_REG_RA, store_offset, RV_REG_SP, ctx);
@@ -198,7 +217,7 @@ static void __build_epilogue(bool is_tail_call, struct rv_jit_context *ctx)
 		store_offset -= 8;
 	}
 
-	emit_addi(RV_REG_SP, RV_REG_SP, stack_adjust, ctx);
+	emit_addi(RV_REG_SP, RV_REG_SP, sp_adjust, ctx);
 	/* Set return value. */
 	if (!is_tail_call)
 		emit_mv(RV_REG_A0, RV_REG_A5, ctx);
@@ -207,6 +226,148 @@ static void __build_epilogue(bool is_tail_call, struct rv_jit_context *ctx)
 		  ctx);
 }
 
+/* Shrink wrapping (CONFIG_BPF_JIT_RISCV_SHRINK_WRAP): the stack frame is
+ * only set up in front of the first insn that needs it, so that programs
+ * which exit early (e.g., after a bounds check) run without one. Code before
+ * the frame uses BPF R0-R5 only, which live in caller-saved registers, and
+ * returns straight to the caller. With the option off, the prologue always
+ * sets up the frame, as before.
+ */
+static bool insn_needs_frame(const struct bpf_insn *insn)
+{
+	switch (insn->code) {
+	case BPF_JMP | BPF_CALL:
+	case BPF_JMP | BPF_TAIL_CALL:
+		return true;
+	}
+	return insn->dst_reg > BPF_REG_5 || insn->src_reg > BPF_REG_5;
+}
+
+static bool insn_is_jump(const struct bpf_insn *insn)
+{
+	u8 class = BPF_CLASS(insn->code), op = BPF_OP(insn->code);
+
+	return (class == BPF_JMP || class == BPF_JMP32) &&
+	       op != BPF_CALL && op != BPF_EXIT && op != BPF_TAIL_CALL;
+}
+
+int bpf_jit_frame_start(struct rv_jit_context *ctx)
+{
+	const struct bpf_prog *prog = ctx->prog;
+	const struct bpf_insn *insn;
+	int i, k, target;
+
+	if (!IS_ENABLED(CONFIG_BPF_JIT_RISCV_SHRINK_WRAP))
+		return 0;
+
+	for (k = 0; k < prog->len; k++)
+		if (insn_needs_frame(&prog->insnsi[k]))
+			break;
+	if (!k)
+		return 0;
+
+	/* Branch and tail call offsets are relative to the start of the
+	 * insn, which would include the frame setup.
+	 */
+	if (k < prog->len && (insn_is_jump(&prog->insnsi[k]) ||
+			      prog->insnsi[k].code == (BPF_JMP | BPF_TAIL_CALL)))
+		return 0;
+
+	/* Jumps must not cross the frame setup in either direction, nor
+	 * run it twice.
+	 */
+	for (i = 0; i < prog->len; i++) {
+		insn = &prog->insnsi[i];
+		if (!insn_is_jump(insn))
+			continue;
+		target = i + insn->off + 1;
+		if (i < k ? target > k : target <= k)
+			return 0;
+	}
+
+	return k;
+}
+
+static void build_frame(struct rv_jit_context *ctx)
+{
+	int stack_adjust = 0, sp_adjust, store_offset, bpf_stack_adjust;
+
+	bpf_stack_adjust = round_up(ctx->prog->aux->stack_depth, 16);
+	if (bpf_stack_adjust)
+		mark_fp(ctx);
+
+	if (seen_reg(RV_REG_RA, ctx))
+		stack_adjust += 8;
+	stack_adjust += 8; /* RV_REG_FP */
+	if (seen_reg(RV_REG_S1, ctx))
+		stack_adjust += 8;
+	if (seen_reg(RV_REG_S2, ctx))
+		stack_adjust += 8;
+	if (seen_reg(RV_REG_S3, ctx))
+		stack_adjust += 8;
+	if (seen_reg(RV_REG_S4, ctx))
+		stack_adjust += 8;
+	if (seen_reg(RV_REG_S5, ctx))
+		stack_adjust += 8;
+	if (seen_reg(RV_REG_S6, ctx))
+		stack_adjust += 8;
+
+	stack_adjust = round_up(stack_adjust, 16);
+	stack_adjust += bpf_stack_adjust;
+
+	sp_adjust = save_area_adjust(stack_adjust, ctx);
+	store_offset = sp_adjust - 8;
+
+	emit_addi(RV_REG_SP, RV_REG_SP, -sp_adjust, ctx);
+
+	if (seen_reg(RV_REG_RA, ctx)) {
+		emit_sd(RV_REG_SP, store_offset, RV_REG_RA, ctx);
+		store_offset -= 8;
+	}
+	emit_sd(RV_REG_SP, store_offset, RV_REG_FP, ctx);
+	store_offset -= 8;
+	if (seen_reg(RV_REG_S1, ctx)) {
+		emit_sd(RV_REG_SP, store_offset, RV_REG_S1, ctx);
+		store_offset -= 8;
+	}
+	if (seen_reg(RV_REG_S2, ctx)) {
+		emit_sd(RV_REG_SP, store_offset, RV_REG_S2, ctx);
+		store_offset -= 8;
+	}
+	if (seen_reg(RV_REG_S3, ctx)) {
+		emit_sd(RV_REG_SP, store_offset, RV_REG_S3, ctx);
+		store_offset -= 8;
+	}
+	if (seen_reg(RV_REG_S4, ctx)) {
+		emit_sd(RV_REG_SP, store_offset, RV_REG_S4, ctx);
+		store_offset -= 8;
+	}
+	if (seen_reg(RV_REG_S5, ctx)) {
+		emit_sd(RV_REG_SP, store_offset, RV_REG_S5, ctx);
+		store_offset -= 8;
+	}
+	if (seen_reg(RV_REG_S6, ctx)) {
+		emit_sd(RV_REG_SP, store_offset, RV_REG_S6, ctx);
+		store_offset -= 8;
+	}
+
+	emit_addi(RV_REG_FP, RV_REG_SP, sp_adjust, ctx);
+
+	if (sp_adjust != stack_adjust)
+		emit_addi(RV_REG_SP, RV_REG_SP, sp_adjust - stack_adjust, ctx);
+
+	if (bpf_stack_adjust)
+		emit_addi(RV_REG_S5, RV_REG_SP, bpf_stack_adjust, ctx);
+
+	/* Program contains calls and tail calls, so RV_REG_TCC need
+	 * to be saved across calls.
+	 */
+	if (seen_tail_call(ctx) && seen_call(ctx))
+		emit_mv(RV_REG_TCC_SAVED, RV_REG_TCC, ctx);
+
+	ctx->stack_size = stack_adjust;
+}
+
 static void emit_bcc(u8 cond, u8 rd, u8 rs, int rvoff,
 		     struct rv_jit_context *ctx)
 {
@@ -249,7 +410,15 @@ static void emit_branch(u8 cond, u8 rd, u8 rs, int rvoff,
 	s64 upper, lower;
 
 	if (is_13b_int(rvoff)) {
-		emit_bcc(cond, rd, rs, rvoff, ctx);
+		/* c.beqz/c.bnez where possible. The long forms below
+		 * skip over a fixed-size 4-byte branch instead.
+		 */
+		if (cond == BPF_JEQ)
+			emit_beq(rd, rs, rvoff, ctx);
+		else if (cond == BPF_JNE)
+			emit_bne(rd, rs, rvoff, ctx);
+		else
+			emit_bcc(cond, rd, rs, rvoff, ctx);
 		return;
 	}
 
@@ -394,12 +563,68 @@ static void emit_sext_32_rd(u8 *rd, struct rv_jit_context *ctx)
 	*rd = RV_REG_T2;
 }
 
+/*
+ * rd = rd / d or rd % d for a constant d != 0 without a divide: a shift or
+ * mask for powers of two, and the multiply-high sequence of
+ * bpf_jit_udiv_magic otherwise.
+ */
+static void emit_udivmod_k(u8 rd, u64 d, bool is64, bool mod,
+			   struct rv_jit_context *ctx)
+{
+	u32 shift;
+	u64 magic;
+
+	if (is_power_of_2(d)) {
+		if (!mod) {
+			shift = __ffs(d);
+			if (is64)
+				emit_srli(rd, rd, shift, ctx);
+			else
+				emit(rv_srliw(rd, rd, shift), ctx);
+		} else if (is_12b_int(d - 1)) {
+			emit_andi(rd, rd, d - 1, ctx);
+		} else {
+			emit_imm(RV_REG_T1, d - 1, ctx);
+			emit_and(rd, rd, RV_REG_T1, ctx);
+		}
+		return;
+	}
+
+	if (!is64)
+		emit_zext_32(rd, ctx);
+
+	magic = bpf_jit_udiv_magic(d, &shift);
+	emit_imm(RV_REG_T1, magic, ctx);
+	emit(rv_mulhu(RV_REG_T1, rd, RV_REG_T1), ctx);
+	emit_sub(RV_REG_T2, rd, RV_REG_T1, ctx);
+	emit_srli(RV_REG_T2, RV_REG_T2, 1, ctx);
+	emit_add(RV_REG_T2, RV_REG_T2, RV_REG_T1, ctx);
+	emit_srli(RV_REG_T2, RV_REG_T2, shift, ctx);
+
+	if (!mod) {
+		emit_mv(rd, RV_REG_T2, ctx);
+		return;
+	}
+
+	emit_imm(RV_REG_T1, d, ctx);
+	if (is64) {
+		emit(rv_mul(RV_REG_T2, RV_REG_T2, RV_REG_T1), ctx);
+		emit_sub(rd, rd, RV_REG_T2, ctx);
+	} else {
+		emit(rv_mulw(RV_REG_T2, RV_REG_T2, RV_REG_T1), ctx);
+		emit_subw(rd, rd, RV_REG_T2, ctx);
+	}
+}
+
 static int emit_jump_and_link(u8 rd, s64 rvoff, bool force_jalr,
 			      struct rv_jit_context *ctx)
 {
 	s64 upper, lower;
 
-	if (rvoff && is_21b_int(rvoff) && !force_jalr) {
+	if (rvc_enabled() && !rd && rvoff && is_12b_int(rvoff) && !force_jalr) {
+		emitc(rvc_j(rvoff), ctx);
+		return 0;
+	} else if (rvoff && is_21b_int(rvoff) && !force_jalr) {
 		emit(rv_jal(rd, rvoff >> 1), ctx);
 		return 0;
 	} else if (in_auipc_jalr_range(rvoff)) {
@@ -440,6 +665,78 @@ static int emit_call(bool fixed, u64 addr, struct rv_jit_context *ctx)
 	return 0;
 }
 
+/*
+ * Exception table fixups for BPF_PROBE_MEM loads. The fixup field holds the
+ * distance back from &ex->fixup to the instruction following the faulting
+ * load in its low bits, and the load's destination register in its top bits.
+ */
+#define BPF_FIXUP_REG_SHIFT	27
+#define BPF_FIXUP_OFFSET_MASK	((1UL << BPF_FIXUP_REG_SHIFT) - 1)
+
+static const int pt_regmap[] = {
+	[RV_REG_T0] = offsetof(struct pt_regs, t0),
+	[RV_REG_S1] = offsetof(struct pt_regs, s1),
+	[RV_REG_A0] = offsetof(struct pt_regs, a0),
+	[RV_REG_A1] = offsetof(struct pt_regs, a1),
+	[RV_REG_A2] = offsetof(struct pt_regs, a2),
+	[RV_REG_A3] = offsetof(struct pt_regs, a3),
+	[RV_REG_A4] = offsetof(struct pt_regs, a4),
+	[RV_REG_A5] = offsetof(struct pt_regs, a5),
+	[RV_REG_S2] = offsetof(struct pt_regs, s2),
+	[RV_REG_S3] = offsetof(struct pt_regs, s3),
+	[RV_REG_S4] = offsetof(struct pt_regs, s4),
+	[RV_REG_S5] = offsetof(struct pt_regs, s5),
+};
+
+/* Called from fixup_exception() when a BPF_PROBE_MEM load faults. */
+int rv_bpf_fixup_exception(const struct exception_table_entry *ex,
+			   struct pt_regs *regs)
+{
+	unsigned long offset = ex->fixup & BPF_FIXUP_OFFSET_MASK;
+	int dst_reg = ex->fixup >> BPF_FIXUP_REG_SHIFT;
+
+	*(unsigned long *)((void *)regs + pt_regmap[dst_reg]) = 0;
+	regs->epc = (unsigned long)&ex->fixup - offset;
+	return 1;
+}
+
+/*
+ * For BPF_PROBE_MEM loads, add an exception table entry for the load that
+ * was just emitted. Faulting loads are always 4 bytes so that the fixup
+ * resumes right after them.
+ */
+static int add_exception_handler(const struct bpf_insn *insn,
+				 struct rv_jit_context *ctx, u8 dst_reg)
+{
+	struct exception_table_entry *ex;
+	unsigned long pc;
+	long offset;
+
+	if (!ctx->insns || BPF_MODE(insn->code) != BPF_PROBE_MEM)
+		return 0;
+
+	if (!ctx->prog->aux->extable ||
+	    WARN_ON_ONCE(ctx->nexentries >= ctx->prog->aux->num_exentries))
+		return -EINVAL;
+
+	ex = &ctx->prog->aux->extable[ctx->nexentries];
+	pc = (unsigned long)&ctx->insns[ctx->ninsns - 2];
+	ex->insn = pc;
+
+	/*
+	 * The extable follows the program, so the distance to the next
+	 * instruction is always positive when measured from &ex->fixup.
+	 */
+	offset = (long)&ex->fixup - (long)(pc + 4);
+	if (offset <= 0 || offset > BPF_FIXUP_OFFSET_MASK)
+		return -ERANGE;
+
+	ex->fixup = offset | ((unsigned long)dst_reg << BPF_FIXUP_REG_SHIFT);
+
+	ctx->nexentries++;
+	return 0;
+}
+
 int bpf_jit_emit_insn(const struct bpf_insn *insn, struct rv_jit_context *ctx,
 		      bool extra_pass)
 {
@@ -451,6 +748,10 @@ int bpf_jit_emit_insn(const struct bpf_insn *insn, struct rv_jit_context *ctx,
 	s16 off = insn->off;
 	s32 imm = insn->imm;
 
+	/* Deferred frame setup, see bpf_jit_frame_start(). */
+	if (i && i == ctx->frame_start)
+		build_frame(ctx);
+
 	init_regs(&rd, &rs, insn, ctx);
 
 	switch (code) {
@@ -686,17 +987,10 @@ out_be:
 		break;
 	case BPF_ALU | BPF_DIV | BPF_K:
 	case BPF_ALU64 | BPF_DIV | BPF_K:
-		emit_imm(RV_REG_T1, imm, ctx);
-		emit(is64 ? rv_divu(rd, rd, RV_REG_T1) :
-		     rv_divuw(rd, rd, RV_REG_T1), ctx);
-		if (!is64 && !aux->verifier_zext)
-			emit_zext_32(rd, ctx);
-		break;
 	case BPF_ALU | BPF_MOD | BPF_K:
 	case BPF_ALU64 | BPF_MOD | BPF_K:
-		emit_imm(RV_REG_T1, imm, ctx);
-		emit(is64 ? rv_remu(rd, rd, RV_REG_T1) :
-		     rv_remuw(rd, rd, RV_REG_T1), ctx);
+		emit_udivmod_k(rd, is64 ? (u64)(s64)imm : (u32)imm, is64,
+			       BPF_OP(code) == BPF_MOD, ctx);
 		if (!is64 && !aux->verifier_zext)
 			emit_zext_32(rd, ctx);
 		break;
@@ -871,6 +1165,12 @@ out_be:
 
 	/* function return */
 	case BPF_JMP | BPF_EXIT:
+		if (i < ctx->frame_start) {
+			/* No stack frame to tear down. */
+			emit_mv(RV_REG_A0, RV_REG_A5, ctx);
+			emit_jalr(RV_REG_ZERO, RV_REG_RA, 0, ctx);
+			break;
+		}
 		if (i == ctx->prog->len - 1)
 			break;
 
@@ -893,38 +1193,59 @@ out_be:
 
 	/* LDX: dst = *(size *)(src + off) */
 	case BPF_LDX | BPF_MEM | BPF_B:
+	case BPF_LDX | BPF_PROBE_MEM | BPF_B:
 		if (is_12b_int(off)) {
 			emit(rv_lbu(rd, off, rs), ctx);
+			ret = add_exception_handler(insn, ctx, rd);
+			if (ret)
+				return ret;
 			break;
 		}
 
 		emit_imm(RV_REG_T1, off, ctx);
 		emit_add(RV_REG_T1, RV_REG_T1, rs, ctx);
 		emit(rv_lbu(rd, 0, RV_REG_T1), ctx);
+		ret = add_exception_handler(insn, ctx, rd);
+		if (ret)
+			return ret;
 		if (insn_is_zext(&insn[1]))
 			return 1;
 		break;
 	case BPF_LDX | BPF_MEM | BPF_H:
+	case BPF_LDX | BPF_PROBE_MEM | BPF_H:
 		if (is_12b_int(off)) {
 			emit(rv_lhu(rd, off, rs), ctx);
+			ret = add_exception_handler(insn, ctx, rd);
+			if (ret)
+				return ret;
 			break;
 		}
 
 		emit_imm(RV_REG_T1, off, ctx);
 		emit_add(RV_REG_T1, RV_REG_T1, rs, ctx);
 		emit(rv_lhu(rd, 0, RV_REG_T1), ctx);
+		ret = add_exception_handler(insn, ctx, rd);
+		if (ret)
+			return ret;
 		if (insn_is_zext(&insn[1]))
 			return 1;
 		break;
 	case BPF_LDX | BPF_MEM | BPF_W:
+	case BPF_LDX | BPF_PROBE_MEM | BPF_W:
 		if (is_12b_int(off)) {
 			emit(rv_lwu(rd, off, rs), ctx);
+			ret = add_exception_handler(insn, ctx, rd);
+			if (ret)
+				return ret;
 			break;
 		}
 
 		emit_imm(RV_REG_T1, off, ctx);
 		emit_add(RV_REG_T1, RV_REG_T1, rs, ctx);
 		emit(rv_lwu(rd, 0, RV_REG_T1), ctx);
+		ret = add_exception_handler(insn, ctx, rd);
+		if (ret)
+			return ret;
 		if (insn_is_zext(&insn[1]))
 			return 1;
 		break;
@@ -938,6 +1259,19 @@ out_be:
 		emit_add(RV_REG_T1, RV_REG_T1, rs, ctx);
 		emit_ld(rd, 0, RV_REG_T1, ctx);
 		break;
+	case BPF_LDX | BPF_PROBE_MEM | BPF_DW:
+		/* Never compressed; see add_exception_handler(). */
+		if (is_12b_int(off)) {
+			emit(rv_ld(rd, off, rs), ctx);
+		} else {
+			emit_imm(RV_REG_T1, off, ctx);
+			emit_add(RV_REG_T1, RV_REG_T1, rs, ctx);
+			emit(rv_ld(rd, 0, RV_REG_T1), ctx);
+		}
+		ret = add_exception_handler(insn, ctx, rd);
+		if (ret)
+			return ret;
+		break;
 
 	/* ST: *(size *)(dst + off) = imm */
 	case BPF_ST | BPF_MEM | BPF_B:
@@ -1056,89 +1390,289 @@ out_be:
 
 void bpf_jit_build_prologue(struct rv_jit_context *ctx)
 {
-	int stack_adjust = 0, store_offset, bpf_stack_adjust;
-
-	bpf_stack_adjust = round_up(ctx->prog->aux->stack_depth, 16);
-	if (bpf_stack_adjust)
-		mark_fp(ctx);
-
-	if (seen_reg(RV_REG_RA, ctx))
-		stack_adjust += 8;
-	stack_adjust += 8; /* RV_REG_FP */
-	if (seen_reg(RV_REG_S1, ctx))
-		stack_adjust += 8;
-	if (seen_reg(RV_REG_S2, ctx))
-		stack_adjust += 8;
-	if (seen_reg(RV_REG_S3, ctx))
-		stack_adjust += 8;
-	if (seen_reg(RV_REG_S4, ctx))
-		stack_adjust += 8;
-	if (seen_reg(RV_REG_S5, ctx))
-		stack_adjust += 8;
-	if (seen_reg(RV_REG_S6, ctx))
-		stack_adjust += 8;
-
-	stack_adjust = round_up(stack_adjust, 16);
-	stack_adjust += bpf_stack_adjust;
-
-	store_offset = stack_adjust - 8;
-
 	/* First instruction is always setting the tail-call-counter
 	 * (TCC) register. This instruction is skipped for tail calls.
 	 * Force using a 4-byte (non-compressed) instruction.
 	 */
 	emit(rv_addi(RV_REG_TCC, RV_REG_ZERO, MAX_TAIL_CALL_CNT), ctx);
 
-	emit_addi(RV_REG_SP, RV_REG_SP, -stack_adjust, ctx);
+	if (!ctx->frame_start)
+		build_frame(ctx);
+}
 
-	if (seen_reg(RV_REG_RA, ctx)) {
-		emit_sd(RV_REG_SP, store_offset, RV_REG_RA, ctx);
-		store_offset -= 8;
+void bpf_jit_build_epilogue(struct rv_jit_context *ctx)
+{
+	__build_epilogue(false, ctx);
+}
+
+/* auipc t0 + jalr t0 at the entry of a traced function */
+#define RV_FENTRY_SIZE	8
+
+/* Call a kernel function or BPF program from a trampoline. The call is
+ * always auipc + jalr so that its size does not depend on the image address.
+ */
+static int emit_tramp_call(u64 addr, struct rv_jit_context *ctx)
+{
+	s64 off = 0;
+	u64 ip;
+
+	if (ctx->insns) {
+		ip = (u64)(long)(ctx->insns + ctx->ninsns);
+		off = addr - ip;
 	}
-	emit_sd(RV_REG_SP, store_offset, RV_REG_FP, ctx);
-	store_offset -= 8;
-	if (seen_reg(RV_REG_S1, ctx)) {
-		emit_sd(RV_REG_SP, store_offset, RV_REG_S1, ctx);
-		store_offset -= 8;
+
+	return emit_jump_and_link(RV_REG_RA, off, true, ctx);
+}
+
+static void save_args(int nr_args, int args_off, struct rv_jit_context *ctx)
+{
+	int i;
+
+	for (i = 0; i < nr_args; i++)
+		emit_sd(RV_REG_FP, -args_off + i * 8, RV_REG_A0 + i, ctx);
+}
+
+static void restore_args(int nr_args, int args_off, struct rv_jit_context *ctx)
+{
+	int i;
+
+	for (i = 0; i < nr_args; i++)
+		emit_ld(RV_REG_A0 + i, -args_off + i * 8, RV_REG_FP, ctx);
+}
+
+static int invoke_bpf_prog(struct bpf_prog *p, int args_off, int retval_off,
+			   bool save_ret, struct rv_jit_context *ctx)
+{
+	int ret;
+
+	ret = emit_tramp_call((u64)__bpf_prog_enter, ctx);
+	if (ret)
+		return ret;
+	/* remember prog start time returned by __bpf_prog_enter */
+	emit_mv(RV_REG_S1, RV_REG_A0, ctx);
+
+	/* arg1: pointer to the saved arguments */
+	emit_addi(RV_REG_A0, RV_REG_FP, -args_off, ctx);
+	/* arg2: progs[i]->insnsi for interpreter */
+	if (!p->jited)
+		emit_imm(RV_REG_A1, (u64)p->insnsi, ctx);
+	ret = emit_tramp_call((u64)p->bpf_func, ctx);
+	if (ret)
+		return ret;
+
+	/* BPF_TRAMP_MODIFY_RETURN programs pass their return value on the
+	 * stack to the next program.
+	 */
+	if (save_ret)
+		emit_sd(RV_REG_FP, -retval_off, RV_REG_A0, ctx);
+
+	emit_imm(RV_REG_A0, (u64)p, ctx);
+	emit_mv(RV_REG_A1, RV_REG_S1, ctx);
+	return emit_tramp_call((u64)__bpf_prog_exit, ctx);
+}
+
+static int invoke_bpf(struct bpf_tramp_progs *tp, int args_off, int retval_off,
+		      struct rv_jit_context *ctx)
+{
+	int i, ret;
+
+	for (i = 0; i < tp->nr_progs; i++) {
+		ret = invoke_bpf_prog(tp->progs[i], args_off, retval_off, false,
+				      ctx);
+		if (ret)
+			return ret;
 	}
-	if (seen_reg(RV_REG_S2, ctx)) {
-		emit_sd(RV_REG_SP, store_offset, RV_REG_S2, ctx);
-		store_offset -= 8;
+	return 0;
+}
+
+static int invoke_bpf_mod_ret(struct bpf_tramp_progs *tp, int args_off,
+			      int retval_off, int *branches_off,
+			      struct rv_jit_context *ctx)
+{
+	int i, ret;
+
+	/* The first fmod_ret program will receive a garbage return value.
+	 * Set this to 0 to avoid confusing the program.
+	 */
+	emit_sd(RV_REG_FP, -retval_off, RV_REG_ZERO, ctx);
+	for (i = 0; i < tp->nr_progs; i++) {
+		ret = invoke_bpf_prog(tp->progs[i], args_off, retval_off, true,
+				      ctx);
+		if (ret)
+			return ret;
+
+		/* if (*(u64 *)(fp - retval_off) != 0) goto do_fexit; */
+		emit_ld(RV_REG_T1, -retval_off, RV_REG_FP, ctx);
+		/* Reserve a 4-byte nop for the branch, which is filled in
+		 * once the location of do_fexit is known.
+		 */
+		branches_off[i] = ctx->ninsns;
+		emit(rv_addi(RV_REG_ZERO, RV_REG_ZERO, 0), ctx);
 	}
-	if (seen_reg(RV_REG_S3, ctx)) {
-		emit_sd(RV_REG_SP, store_offset, RV_REG_S3, ctx);
-		store_offset -= 8;
+	return 0;
+}
+
+/*
+ * Trampolines attached at the entry of a traced function are called with
+ * "jalr t0" from the patched entry, so that RA still holds the return
+ * address of the traced function. Other trampolines are called normally.
+ *
+ * Stack layout, relative to FP (the SP on entry):
+ *
+ * FP - 8          [ RA            ]
+ * FP - 16         [ FP            ]
+ * FP - 24         [ T0            ] return address into the traced
+ *                                   function, for function entry only
+ * FP - 32         [ S1            ] start time from __bpf_prog_enter
+ * FP - retval_off [ return value  ] of orig_call or fmod_ret programs
+ * FP - args_off   [ arg1 ... argN ]
+ *
+ * The return value directly follows the arguments, so that fexit programs
+ * can access it as the last element of their context.
+ */
+static int __arch_prepare_bpf_trampoline(const struct btf_func_model *m,
+					 u32 flags,
+					 struct bpf_tramp_progs *tprogs,
+					 void *orig_call,
+					 struct rv_jit_context *ctx)
+{
+	int i, ret, offset, nr_args = m->nr_args;
+	int stack_size, retval_off = 40, args_off;
+	struct bpf_tramp_progs *fentry = &tprogs[BPF_TRAMP_FENTRY];
+	struct bpf_tramp_progs *fexit = &tprogs[BPF_TRAMP_FEXIT];
+	struct bpf_tramp_progs *fmod_ret = &tprogs[BPF_TRAMP_MODIFY_RETURN];
+	bool func_entry = flags & (BPF_TRAMP_F_RESTORE_REGS |
+				   BPF_TRAMP_F_SKIP_FRAME);
+	int *branches_off = NULL;
+	u32 insn;
+
+	/* Arguments are passed in a0-a7 */
+	if (nr_args > 8)
+		return -ENOTSUPP;
+
+	if ((flags & BPF_TRAMP_F_RESTORE_REGS) &&
+	    (flags & BPF_TRAMP_F_SKIP_FRAME))
+		return -EINVAL;
+
+	args_off = retval_off + nr_args * 8;
+	stack_size = round_up(args_off, 16);
+
+	if (flags & BPF_TRAMP_F_SKIP_FRAME)
+		/* skip the patched entry and call the body of the function */
+		orig_call += RV_FENTRY_SIZE;
+
+	emit_addi(RV_REG_SP, RV_REG_SP, -stack_size, ctx);
+	emit_sd(RV_REG_SP, stack_size - 8, RV_REG_RA, ctx);
+	emit_sd(RV_REG_SP, stack_size - 16, RV_REG_FP, ctx);
+	if (func_entry)
+		emit_sd(RV_REG_SP, stack_size - 24, RV_REG_T0, ctx);
+	emit_sd(RV_REG_SP, stack_size - 32, RV_REG_S1, ctx);
+	emit_addi(RV_REG_FP, RV_REG_SP, stack_size, ctx);
+
+	save_args(nr_args, args_off, ctx);
+
+	if (fentry->nr_progs) {
+		ret = invoke_bpf(fentry, args_off, retval_off, ctx);
+		if (ret)
+			return ret;
 	}
-	if (seen_reg(RV_REG_S4, ctx)) {
-		emit_sd(RV_REG_SP, store_offset, RV_REG_S4, ctx);
-		store_offset -= 8;
+
+	if (fmod_ret->nr_progs) {
+		branches_off = kcalloc(fmod_ret->nr_progs, sizeof(int),
+				       GFP_KERNEL);
+		if (!branches_off)
+			return -ENOMEM;
+
+		ret = invoke_bpf_mod_ret(fmod_ret, args_off, retval_off,
+					 branches_off, ctx);
+		if (ret)
+			goto out;
 	}
-	if (seen_reg(RV_REG_S5, ctx)) {
-		emit_sd(RV_REG_SP, store_offset, RV_REG_S5, ctx);
-		store_offset -= 8;
+
+	if (flags & BPF_TRAMP_F_CALL_ORIG) {
+		if (fentry->nr_progs || fmod_ret->nr_progs)
+			restore_args(nr_args, args_off, ctx);
+
+		ret = emit_tramp_call((u64)orig_call, ctx);
+		if (ret)
+			goto out;
+		/* remember return value in a stack for bpf prog to access */
+		emit_sd(RV_REG_FP, -retval_off, RV_REG_A0, ctx);
 	}
-	if (seen_reg(RV_REG_S6, ctx)) {
-		emit_sd(RV_REG_SP, store_offset, RV_REG_S6, ctx);
-		store_offset -= 8;
+
+	/* do_fexit: fill in the branches of invoke_bpf_mod_ret. */
+	for (i = 0; i < fmod_ret->nr_progs; i++) {
+		offset = ninsns_rvoff(ctx->ninsns - branches_off[i]);
+		if (!is_13b_int(offset)) {
+			ret = -E2BIG;
+			goto out;
+		}
+		insn = rv_bne(RV_REG_T1, RV_REG_ZERO, offset >> 1);
+		if (ctx->insns) {
+			ctx->insns[branches_off[i]] = insn;
+			ctx->insns[branches_off[i] + 1] = insn >> 16;
+		}
 	}
 
-	emit_addi(RV_REG_FP, RV_REG_SP, stack_adjust, ctx);
+	if (fexit->nr_progs) {
+		ret = invoke_bpf(fexit, args_off, retval_off, ctx);
+		if (ret)
+			goto out;
+	}
 
-	if (bpf_stack_adjust)
-		emit_addi(RV_REG_S5, RV_REG_SP, bpf_stack_adjust, ctx);
+	if (flags & BPF_TRAMP_F_RESTORE_REGS)
+		restore_args(nr_args, args_off, ctx);
 
-	/* Program contains calls and tail calls, so RV_REG_TCC need
-	 * to be saved across calls.
+	/* If there were fmod_ret programs, the return value is only updated
+	 * on the stack and still needs to be restored to a0.
 	 */
-	if (seen_tail_call(ctx) && seen_call(ctx))
-		emit_mv(RV_REG_TCC_SAVED, RV_REG_TCC, ctx);
-
-	ctx->stack_size = stack_adjust;
+	if (flags & BPF_TRAMP_F_CALL_ORIG)
+		emit_ld(RV_REG_A0, -retval_off, RV_REG_FP, ctx);
+
+	emit_ld(RV_REG_S1, stack_size - 32, RV_REG_SP, ctx);
+	if (func_entry)
+		emit_ld(RV_REG_T0, stack_size - 24, RV_REG_SP, ctx);
+	emit_ld(RV_REG_FP, stack_size - 16, RV_REG_SP, ctx);
+	emit_ld(RV_REG_RA, stack_size - 8, RV_REG_SP, ctx);
+	emit_addi(RV_REG_SP, RV_REG_SP, stack_size, ctx);
+
+	if (func_entry && !(flags & BPF_TRAMP_F_SKIP_FRAME))
+		/* return to the body of the traced function */
+		emit_jalr(RV_REG_ZERO, RV_REG_T0, 0, ctx);
+	else
+		emit_jalr(RV_REG_ZERO, RV_REG_RA, 0, ctx);
+
+	ret = ctx->ninsns;
+out:
+	kfree(branches_off);
+	return ret;
 }
 
-void bpf_jit_build_epilogue(struct rv_jit_context *ctx)
+int arch_prepare_bpf_trampoline(void *image, void *image_end,
+				const struct btf_func_model *m, u32 flags,
+				struct bpf_tramp_progs *tprogs,
+				void *orig_call)
 {
-	__build_epilogue(false, ctx);
+	struct rv_jit_context ctx = {};
+	int ret;
+
+	/* First pass: compute the size of the trampoline. */
+	ret = __arch_prepare_bpf_trampoline(m, flags, tprogs, orig_call, &ctx);
+	if (ret < 0)
+		return ret;
+
+	if (ninsns_rvoff(ret) > (long)image_end - (long)image)
+		return -EFBIG;
+
+	ctx.ninsns = 0;
+	ctx.insns = image;
+	ret = __arch_prepare_bpf_trampoline(m, flags, tprogs, orig_call, &ctx);
+	if (ret < 0)
+		return ret;
+
+	bpf_flush_icache(ctx.insns, ctx.insns + ctx.ninsns);
+
+	return ninsns_rvoff(ret);
 }
 
 void *bpf_jit_alloc_exec(unsigned long size)
@@ -8,10 +8,14 @@
 
 #include <linux/bpf.h>
 #include <linux/filter.h>
+#include <asm/extable.h>
 #include "bpf_jit.h"
 
-/* Number of iterations to try until offsets converge. */
-#define NR_JIT_ITERATIONS	16
+/* Number of iterations to try until offsets converge. Compressed branches
+ * and jumps shrink the image a little further on each pass, so allow for a
+ * few more passes than without them.
+ */
+#define NR_JIT_ITERATIONS	32
 
 static int build_body(struct rv_jit_context *ctx, bool extra_pass, int *offset)
 {
@@ -34,6 +38,14 @@ static int build_body(struct rv_jit_context *ctx, bool extra_pass, int *offset)
 	return 0;
 }
 
+/* BPF insn in front of which the stack frame is set up; 0 sets it up in
+ * the prologue.
+ */
+int __weak bpf_jit_frame_start(struct rv_jit_context *ctx)
+{
+	return 0;
+}
+
 bool bpf_jit_needs_zext(void)
 {
 	return true;
@@ -46,7 +58,7 @@ struct bpf_prog *bpf_int_jit_compile(struct bpf_prog *prog)
 	int pass = 0, prev_ninsns = 0, i;
 	struct rv_jit_data *jit_data;
 	struct rv_jit_context *ctx;
-	unsigned int image_size = 0;
+	unsigned int image_size = 0, extable_size, extable_offset;
 
 	if (!prog->jit_requested)
 		return orig_prog;
@@ -78,11 +90,19 @@ struct bpf_prog *bpf_int_jit_compile(struct bpf_prog *prog)
 	}
 
 	ctx->prog = prog;
+	ctx->frame_start = bpf_jit_frame_start(ctx);
 	ctx->offset = kcalloc(prog->len, sizeof(int), GFP_KERNEL);
 	if (!ctx->offset) {
 		prog = orig_prog;
 		goto out_offset;
 	}
+	ctx->jmp_targets = bitmap_zalloc(prog->len, GFP_KERNEL);
+	if (!ctx->jmp_targets) {
+		prog = orig_prog;
+		goto out_offset;
+	}
+	bpf_jit_mark_jmp_targets(prog->insnsi, prog->len, ctx->jmp_targets);
+
 	for (i = 0; i < prog->len; i++) {
 		prev_ninsns += 32;
 		ctx->offset[i] = prev_ninsns;
@@ -91,6 +111,7 @@ struct bpf_prog *bpf_int_jit_compile(struct bpf_prog *prog)
 	for (i = 0; i < NR_JIT_ITERATIONS; i++) {
 		pass++;
 		ctx->ninsns = 0;
+		ctx->nexentries = 0;
 		if (build_body(ctx, extra_pass, ctx->offset)) {
 			prog = orig_prog;
 			goto out_offset;
@@ -103,9 +124,17 @@ struct bpf_prog *bpf_int_jit_compile(struct bpf_prog *prog)
 			if (jit_data->header)
 				break;
 
+			/*
+			 * The extable for BPF_PROBE_MEM loads follows the
+			 * program in the same allocation.
+			 */
 			image_size = sizeof(*ctx->insns) * ctx->ninsns;
+			extable_offset = roundup(image_size,
+				__alignof__(struct exception_table_entry));
+			extable_size = prog->aux->num_exentries *
+				sizeof(struct exception_table_entry);
 			jit_data->header =
-				bpf_jit_binary_alloc(image_size,
+				bpf_jit_binary_alloc(extable_offset + extable_size,
 						     &jit_data->image,
 						     sizeof(u32),
 						     bpf_fill_ill_insns);
@@ -115,6 +144,9 @@ struct bpf_prog *bpf_int_jit_compile(struct bpf_prog *prog)
 			}
 
 			ctx->insns = (u16 *)jit_data->image;
+			if (extable_size)
+				prog->aux->extable =
+					(void *)jit_data->image + extable_offset;
 			/*
 			 * Now, when the image is allocated, the image can
 			 * potentially shrink more (auipc/jalr -> jal).
@@ -133,6 +165,7 @@ struct bpf_prog *bpf_int_jit_compile(struct bpf_prog *prog)
 skip_init_ctx:
 	pass++;
 	ctx->ninsns = 0;
+	ctx->nexentries = 0;
 
 	bpf_jit_build_prologue(ctx);
 	if (build_body(ctx, extra_pass, NULL)) {
@@ -142,6 +175,13 @@ skip_init_ctx:
 	}
 	bpf_jit_build_epilogue(ctx);
 
+	if (ctx->nexentries != prog->aux->num_exentries) {
+		pr_err("bpf-jit: extable is not populated\n");
+		bpf_jit_binary_free(jit_data->header);
+		prog = orig_prog;
+		goto out_offset;
+	}
+
 	if (bpf_jit_enable > 1)
 		bpf_jit_dump(prog->len, image_size, pass, ctx->insns);
 
@@ -153,6 +193,7 @@ skip_init_ctx:
 
 	if (!prog->is_func || extra_pass) {
 out_offset:
+		bitmap_free(ctx->jmp_targets);
 		kfree(ctx->offset);
 		kfree(jit_data);
 		prog->aux->jit_data = NULL;
@@ -11,6 +11,8 @@
 #include <linux/bpf.h>
 #include <linux/memory.h>
 #include <linux/sort.h>
+#include <linux/bitmap.h>
+#include <linux/log2.h>
 #include <asm/extable.h>
 #include <asm/set_memory.h>
 #include <asm/nospec-branch.h>
@@ -215,6 +217,80 @@ struct jit_context {
 	int cleanup_addr; /* Epilogue code offset */
 };
 
+/*
+ * Layout of one JITed insn: @fixed bytes that do not depend on addrs[],
+ * followed by a jump of @kind to the end of insn @target, currently
+ * @len bytes long.
+ */
+enum {
+	JIT_JMP_NONE,
+	JIT_JMP_COND,	/* jcc rel8 or jcc rel32 */
+	JIT_JMP_JA,	/* nothing, jmp rel8 or jmp rel32 */
+	JIT_JMP_EXIT,	/* jmp rel8 or jmp rel32 to the epilogue */
+};
+
+struct jit_layout {
+	int fixed;
+	int target;
+	u8 kind;
+	u8 len;
+};
+
+static void jit_layout_jmp(struct jit_layout *l, u8 kind, int target,
+			   int fixed)
+{
+	l->kind = kind;
+	l->target = target;
+	l->fixed = fixed;
+}
+
+/* Bytes do_jit() emits for a jump of @kind at offset @jmp_offset */
+static int jit_jmp_size(u8 kind, s64 jmp_offset)
+{
+	if (kind == JIT_JMP_NONE)
+		return 0;
+	if (kind == JIT_JMP_JA && !jmp_offset)
+		return 0;
+	if (is_imm8(jmp_offset))
+		return 2;
+	return kind == JIT_JMP_COND ? 6 : 5;
+}
+
+/*
+ * Lay out addrs[] from the insns recorded by do_jit(). Every jump starts
+ * at its longest encoding; each round recomputes all jump sizes from the
+ * previous round's addrs[]. Sizes only shrink, so jump distances only
+ * shrink and the loop stops at a layout that do_jit() reproduces exactly.
+ */
+static int jit_relax(struct jit_layout *layout, int *addrs, int insn_cnt)
+{
+	bool changed;
+	int i, len;
+
+	for (i = 1; i <= insn_cnt; i++)
+		layout[i].len = jit_jmp_size(layout[i].kind, S32_MAX);
+
+	do {
+		for (i = 1; i <= insn_cnt; i++)
+			addrs[i] = addrs[i - 1] + layout[i].fixed + layout[i].len;
+
+		changed = false;
+		for (i = 1; i <= insn_cnt; i++) {
+			if (layout[i].kind == JIT_JMP_NONE)
+				continue;
+			len = jit_jmp_size(layout[i].kind,
+					   addrs[layout[i].target] - addrs[i]);
+			if (len != layout[i].len) {
+				layout[i].len = len;
+				changed = true;
+			}
+		}
+		cond_resched();
+	} while (changed);
+
+	return addrs[insn_cnt];
+}
+
 /* Maximum number of bytes emitted while JITing one eBPF insn */
 #define BPF_MAX_INSN_SIZE	128
 #define BPF_INSN_SAFETY		64
@@ -337,24 +413,38 @@ int bpf_arch_text_poke(void *ip, enum bpf_text_poke_type t,
 	return __bpf_arch_text_poke(ip, t, old_addr, new_addr, true);
 }
 
+/*
+ * tail_call_cnt is kept in the upper half of the qword pushed last by the
+ * prologue, below the BPF stack and the four callee-saved registers.
+ */
+static int tail_call_cnt_off(u32 stack_depth)
+{
+	return -36 - round_up(stack_depth, 8);
+}
+
 /*
  * Generate the following code:
  *
  * ... bpf_tail_call(void *ctx, struct bpf_array *array, u64 index) ...
  *   if (index >= array->map.max_entries)
  *     goto out;
- *   if (++tail_call_cnt > MAX_TAIL_CALL_CNT)
+ *   if (tail_call_cnt > MAX_TAIL_CALL_CNT)
  *     goto out;
  *   prog = array->ptrs[index];
  *   if (prog == NULL)
  *     goto out;
+ *   tail_call_cnt++;
  *   goto *(prog->bpf_func + prologue_size);
  * out:
+ *
+ * The counter is only written back once the jump is certain, so the
+ * fall-through paths perform no stores.
  */
-static void emit_bpf_tail_call_indirect(u8 **pprog)
+static void emit_bpf_tail_call_indirect(u8 **pprog, u32 stack_depth)
 {
 	u8 *prog = *pprog;
 	int label1, label2, label3;
+	int tcc_off = tail_call_cnt_off(stack_depth);
 	int cnt = 0;
 
 	/*
@@ -378,29 +468,31 @@ static void emit_bpf_tail_call_indirect(u8 **pprog)
 	 * if (tail_call_cnt > MAX_TAIL_CALL_CNT)
 	 *	goto out;
 	 */
-	EMIT2_off32(0x8B, 0x85, -36 - MAX_BPF_STACK); /* mov eax, dword ptr [rbp - 548] */
+	EMIT2_off32(0x8B, 0x85, tcc_off);         /* mov eax, dword ptr [rbp + tcc_off] */
 	EMIT3(0x83, 0xF8, MAX_TAIL_CALL_CNT);     /* cmp eax, MAX_TAIL_CALL_CNT */
 #define OFFSET2 (30 + RETPOLINE_RAX_BPF_JIT_SIZE)
 	EMIT2(X86_JA, OFFSET2);                   /* ja out */
 	label2 = cnt;
-	EMIT3(0x83, 0xC0, 0x01);                  /* add eax, 1 */
-	EMIT2_off32(0x89, 0x85, -36 - MAX_BPF_STACK); /* mov dword ptr [rbp -548], eax */
 
 	/* prog = array->ptrs[index]; */
-	EMIT4_off32(0x48, 0x8B, 0x84, 0xD6,       /* mov rax, [rsi + rdx * 8 + offsetof(...)] */
+	EMIT4_off32(0x48, 0x8B, 0x8C, 0xD6,       /* mov rcx, [rsi + rdx * 8 + offsetof(...)] */
 		    offsetof(struct bpf_array, ptrs));
 
 	/*
 	 * if (prog == NULL)
 	 *	goto out;
 	 */
-	EMIT3(0x48, 0x85, 0xC0);		  /* test rax,rax */
-#define OFFSET3 (8 + RETPOLINE_RAX_BPF_JIT_SIZE)
+	EMIT3(0x48, 0x85, 0xC9);                  /* test rcx,rcx */
+#define OFFSET3 (17 + RETPOLINE_RAX_BPF_JIT_SIZE)
 	EMIT2(X86_JE, OFFSET3);                   /* je out */
 	label3 = cnt;
 
+	/* tail_call_cnt++; */
+	EMIT3(0x83, 0xC0, 0x01);                  /* add eax, 1 */
+	EMIT2_off32(0x89, 0x85, tcc_off);         /* mov dword ptr [rbp + tcc_off], eax */
+
 	/* goto *(prog->bpf_func + prologue_size); */
-	EMIT4(0x48, 0x8B, 0x40,                   /* mov rax, qword ptr [rax + 32] */
+	EMIT4(0x48, 0x8B, 0x41,                   /* mov rax, qword ptr [rcx + 32] */
 	      offsetof(struct bpf_prog, bpf_func));
 	EMIT4(0x48, 0x83, 0xC0, PROLOGUE_SIZE);   /* add rax, prologue_size */
 
@@ -419,20 +511,22 @@ static void emit_bpf_tail_call_indirect(u8 **pprog)
 }
 
 static void emit_bpf_tail_call_direct(struct bpf_jit_poke_descriptor *poke,
-				      u8 **pprog, int addr, u8 *image)
+				      u8 **pprog, int addr, u8 *image,
+				      u32 stack_depth)
 {
 	u8 *prog = *pprog;
+	int tcc_off = tail_call_cnt_off(stack_depth);
 	int cnt = 0;
 
 	/*
 	 * if (tail_call_cnt > MAX_TAIL_CALL_CNT)
 	 *	goto out;
 	 */
-	EMIT2_off32(0x8B, 0x85, -36 - MAX_BPF_STACK); /* mov eax, dword ptr [rbp - 548] */
+	EMIT2_off32(0x8B, 0x85, tcc_off);             /* mov eax, dword ptr [rbp + tcc_off] */
 	EMIT3(0x83, 0xF8, MAX_TAIL_CALL_CNT);         /* cmp eax, MAX_TAIL_CALL_CNT */
 	EMIT2(X86_JA, 14);                            /* ja out */
 	EMIT3(0x83, 0xC0, 0x01);                      /* add eax, 1 */
-	EMIT2_off32(0x89, 0x85, -36 - MAX_BPF_STACK); /* mov dword ptr [rbp -548], eax */
+	EMIT2_off32(0x89, 0x85, tcc_off);             /* mov dword ptr [rbp + tcc_off], eax */
 
 	poke->ip = image + (addr - X86_PATCH_SIZE);
 	poke->adj_off = PROLOGUE_SIZE;
@@ -563,6 +657,132 @@ static void emit_mov_reg(u8 **pprog, bool is64, u32 dst_reg, u32 src_reg)
 	*pprog = prog;
 }
 
+/*
+ * Emit a 3-byte VEX prefix. r and b extend ModR/M.reg and ModR/M.rm, x
+ * extends SIB.index, m selects the opcode map, w is the operand size,
+ * src_reg2 is the extra operand encoded in vvvv, and pp stands for an
+ * implied 0x66/0xF3/0xF2 prefix.
+ */
+static void emit_3vex(u8 **pprog, bool r, bool x, bool b, u8 m,
+		      bool w, u32 src_reg2, bool l, u8 pp)
+{
+	u8 *prog = *pprog;
+	const u8 b0 = 0xC4; /* first byte of 3-byte VEX prefix */
+	u8 b1, b2, vvvv;
+	int cnt = 0;
+
+	/* reg2hex gives only the lower 3 bits of vvvv */
+	vvvv = reg2hex[src_reg2];
+	if (is_ereg(src_reg2))
+		vvvv |= 1 << 3;
+
+	/* R, X, B and vvvv are stored inverted */
+	b1 = (!r << 7) | (!x << 6) | (!b << 5) | (m & 0x1f);
+	b2 = (w << 7) | ((~vvvv & 0xf) << 3) | (l << 2) | (pp & 3);
+
+	EMIT3(b0, b1, b2);
+	*pprog = prog;
+}
+
+/* shlx/sarx/shrx dst, dst, src, as selected by the implied prefix op */
+static void emit_shiftx(u8 **pprog, u32 dst_reg, u32 src_reg, bool is64,
+			u8 op)
+{
+	u8 *prog = *pprog;
+	bool r = is_ereg(dst_reg);
+	int cnt = 0;
+
+	/* opcode map 0F38 */
+	emit_3vex(&prog, r, false, r, 2, is64, src_reg, false, op);
+	EMIT2(0xF7, add_2reg(0xC0, dst_reg, dst_reg));
+	*pprog = prog;
+}
+
+/*
+ * dst = dst / d or dst % d for a constant d != 0 without a divide: a shift
+ * or mask for powers of two, and the multiply-high sequence of
+ * bpf_jit_udiv_magic otherwise.
+ */
+static void emit_udivmod_k(u8 **pprog, u32 dst_reg, u64 d, bool is64,
+			   bool mod)
+{
+	u8 *prog = *pprog;
+	int cnt = 0;
+	u32 shift;
+	u64 magic;
+
+	if (is_power_of_2(d)) {
+		if (is64)
+			EMIT1(add_1mod(0x48, dst_reg));
+		else if (is_ereg(dst_reg))
+			EMIT1(add_1mod(0x40, dst_reg));
+
+		if (mod) {
+			/* and dst_reg, d - 1 */
+			if (is_imm8(d - 1))
+				EMIT3(0x83, add_1reg(0xE0, dst_reg), d - 1);
+			else if (is_axreg(dst_reg))
+				EMIT1_off32(0x25, d - 1);
+			else
+				EMIT2_off32(0x81, add_1reg(0xE0, dst_reg), d - 1);
+		} else {
+			/* shr dst_reg, log2(d) */
+			shift = __ffs(d);
+			if (shift == 1)
+				EMIT2(0xD1, add_1reg(0xE8, dst_reg));
+			else
+				EMIT3(0xC1, add_1reg(0xE8, dst_reg), shift);
+		}
+
+		*pprog = prog;
+		return;
+	}
+
+	magic = bpf_jit_udiv_magic(d, &shift);
+
+	EMIT1(0x50); /* push rax */
+	EMIT1(0x52); /* push rdx */
+
+	/* mov r11, dst_reg */
+	emit_mov_reg(&prog, is64, AUX_REG, dst_reg);
+	/* movabs rax, magic */
+	emit_mov_imm64(&prog, BPF_REG_0, magic >> 32, (u32) magic);
+	/* mul r11 */
+	EMIT3(0x49, 0xF7, 0xE3);
+	if (mod)
+		/* mov rax, r11 */
+		EMIT3(0x4C, 0x89, 0xD8);
+
+	EMIT3(0x49, 0x29, 0xD3);        /* sub r11, rdx */
+	EMIT3(0x49, 0xD1, 0xEB);        /* shr r11, 1 */
+	EMIT3(0x49, 0x01, 0xD3);        /* add r11, rdx */
+	EMIT4(0x49, 0xC1, 0xEB, shift); /* shr r11, shift */
+
+	if (mod) {
+		if (is64) {
+			/* imul r11, r11, d */
+			EMIT3_off32(0x4D, 0x69, 0xDB, d);
+			/* sub rax, r11 */
+			EMIT3(0x4C, 0x29, 0xD8);
+		} else {
+			/* imul r11d, r11d, d */
+			EMIT3_off32(0x45, 0x69, 0xDB, d);
+			/* sub eax, r11d */
+			EMIT3(0x44, 0x29, 0xD8);
+		}
+		/* mov r11, rax */
+		EMIT3(0x49, 0x89, 0xC3);
+	}
+
+	EMIT1(0x5A); /* pop rdx */
+	EMIT1(0x58); /* pop rax */
+
+	/* mov dst_reg, r11 */
+	EMIT_mov(dst_reg, AUX_REG);
+
+	*pprog = prog;
+}
+
 /* LDX: dst_reg = *(u8*)(src_reg + off) */
 static void emit_ldx(u8 **pprog, u32 size, u32 dst_reg, u32 src_reg, int off)
 {
@@ -653,11 +873,13 @@ static bool ex_handler_bpf(const struct exception_table_entry *x,
 }
 
 static int do_jit(struct bpf_prog *bpf_prog, int *addrs, u8 *image,
-		  int oldproglen, struct jit_context *ctx)
+		  int oldproglen, struct jit_context *ctx,
+		  struct jit_layout *layout)
 {
 	struct bpf_insn *insn = bpf_prog->insnsi;
 	int insn_cnt = bpf_prog->len;
 	bool seen_exit = false;
+	int cleanup_idx = 0;
 	u8 temp[BPF_MAX_INSN_SIZE + BPF_INSN_SAFETY];
 	int i, cnt = 0, excnt = 0;
 	int proglen = 0;
@@ -782,24 +1004,30 @@ static int do_jit(struct bpf_prog *bpf_prog, int *addrs, u8 *image,
 			i++;
 			break;
 
-			/* dst %= src, dst /= src, dst %= imm32, dst /= imm32 */
-		case BPF_ALU | BPF_MOD | BPF_X:
-		case BPF_ALU | BPF_DIV | BPF_X:
+			/* dst %= imm32, dst /= imm32 */
 		case BPF_ALU | BPF_MOD | BPF_K:
 		case BPF_ALU | BPF_DIV | BPF_K:
-		case BPF_ALU64 | BPF_MOD | BPF_X:
-		case BPF_ALU64 | BPF_DIV | BPF_X:
 		case BPF_ALU64 | BPF_MOD | BPF_K:
 		case BPF_ALU64 | BPF_DIV | BPF_K:
+		{
+			bool is64 = BPF_CLASS(insn->code) == BPF_ALU64;
+
+			emit_udivmod_k(&prog, dst_reg,
+				       is64 ? (u64)(s64)imm32 : (u32)imm32,
+				       is64, BPF_OP(insn->code) == BPF_MOD);
+			break;
+		}
+
+			/* dst %= src, dst /= src */
+		case BPF_ALU | BPF_MOD | BPF_X:
+		case BPF_ALU | BPF_DIV | BPF_X:
+		case BPF_ALU64 | BPF_MOD | BPF_X:
+		case BPF_ALU64 | BPF_DIV | BPF_X:
 			EMIT1(0x50); /* push rax */
 			EMIT1(0x52); /* push rdx */
 
-			if (BPF_SRC(insn->code) == BPF_X)
-				/* mov r11, src_reg */
-				EMIT_mov(AUX_REG, src_reg);
-			else
-				/* mov r11, imm32 */
-				EMIT3_off32(0x49, 0xC7, 0xC3, imm32);
+			/* mov r11, src_reg */
+			EMIT_mov(AUX_REG, src_reg);
 
 			/* mov rax, dst_reg */
 			EMIT_mov(BPF_REG_0, dst_reg);
@@ -898,6 +1126,29 @@ static int do_jit(struct bpf_prog *bpf_prog, int *addrs, u8 *image,
 		case BPF_ALU64 | BPF_RSH | BPF_X:
 		case BPF_ALU64 | BPF_ARSH | BPF_X:
 
+			/* BMI2 shifts take the count in any register */
+			if (boot_cpu_has(X86_FEATURE_BMI2) &&
+			    src_reg != BPF_REG_4) {
+				bool is64 = BPF_CLASS(insn->code) == BPF_ALU64;
+				u8 op;
+
+				switch (BPF_OP(insn->code)) {
+				case BPF_LSH:
+					op = 1; /* prefix 0x66 */
+					break;
+				case BPF_ARSH:
+					op = 2; /* prefix 0xF3 */
+					break;
+				case BPF_RSH:
+					op = 3; /* prefix 0xF2 */
+					break;
+				default: /* to silence GCC warning */
+					return -EFAULT;
+				}
+				emit_shiftx(&prog, dst_reg, src_reg, is64, op);
+				break;
+			}
+
 			/* Check for bad case when dst_reg == rcx */
 			if (dst_reg == BPF_REG_4) {
 				/* mov r11, dst_reg */
@@ -1109,9 +1360,11 @@ xadd:			if (is_imm8(insn->off))
 		case BPF_JMP | BPF_TAIL_CALL:
 			if (imm32)
 				emit_bpf_tail_call_direct(&bpf_prog->aux->poke_tab[imm32 - 1],
-							  &prog, addrs[i], image);
+							  &prog, addrs[i], image,
+							  bpf_prog->aux->stack_depth);
 			else
-				emit_bpf_tail_call_indirect(&prog);
+				emit_bpf_tail_call_indirect(&prog,
+							    bpf_prog->aux->stack_depth);
 			break;
 
 			/* cond jump */
@@ -1248,6 +1501,9 @@ emit_cond_jmp:		/* Convert BPF opcode to x86 */
 			default: /* to silence GCC warning */
 				return -EFAULT;
 			}
+			if (layout)
+				jit_layout_jmp(&layout[i], JIT_JMP_COND,
+					       i + insn->off, prog - temp);
 			jmp_offset = addrs[i + insn->off] - addrs[i];
 			if (is_imm8(jmp_offset)) {
 				EMIT2(jmp_cond, jmp_offset);
@@ -1272,6 +1528,10 @@ emit_cond_jmp:		/* Convert BPF opcode to x86 */
 			else
 				jmp_offset = addrs[i + insn->off] - addrs[i];
 
+			if (layout && insn->off != -1)
+				jit_layout_jmp(&layout[i], JIT_JMP_JA,
+					       i + insn->off, prog - temp);
+
 			if (!jmp_offset)
 				/* Optimize out nop jumps */
 				break;
@@ -1288,12 +1548,16 @@ emit_jmp:
 
 		case BPF_JMP | BPF_EXIT:
 			if (seen_exit) {
+				if (layout)
+					jit_layout_jmp(&layout[i], JIT_JMP_EXIT,
+						       cleanup_idx, prog - temp);
 				jmp_offset = ctx->cleanup_addr - addrs[i];
 				goto emit_jmp;
 			}
 			seen_exit = true;
 			/* Update cleanup_addr */
 			ctx->cleanup_addr = proglen;
+			cleanup_idx = i - 1;
 			if (!bpf_prog_was_classic(bpf_prog))
 				EMIT1(0x5B); /* get rid of tail_call_cnt */
 			EMIT2(0x41, 0x5F);   /* pop r15 */
@@ -1321,6 +1585,9 @@ emit_jmp:
 			return -EFAULT;
 		}
 
+		if (layout && !layout[i].kind)
+			layout[i].fixed = ilen;
+
 		if (image) {
 			if (unlikely(proglen + ilen > oldproglen)) {
 				pr_err("bpf_jit: fatal error\n");
@@ -1710,7 +1977,12 @@ static int emit_fallback_jump(u8 **pprog)
 	return err;
 }
 
-static int emit_bpf_dispatcher(u8 **pprog, int a, int b, s64 *progs)
+/*
+ * Search over the programs sorted by address (@keys is NULL), or over
+ * their hashed addresses in eax (see arch_prepare_bpf_dispatcher()).
+ * Leaves always compare the full address in rdx.
+ */
+static int emit_bpf_dispatcher(u8 **pprog, int a, int b, s64 *progs, u8 *keys)
 {
 	u8 *jg_reloc, *prog = *pprog;
 	int pivot, err, jg_bytes = 1, cnt = 0;
@@ -1743,10 +2015,15 @@ static int emit_bpf_dispatcher(u8 **pprog, int a, int b, s64 *progs)
 	 * the lower and upper ranges.
 	 */
 	pivot = (b - a) / 2;
-	EMIT1(add_1mod(0x48, BPF_REG_3));		/* cmp rdx,func */
-	if (!is_simm32(progs[a + pivot]))
-		return -1;
-	EMIT2_off32(0x81, add_1reg(0xF8, BPF_REG_3), progs[a + pivot]);
+	if (keys) {
+		EMIT3(0x83, add_1reg(0xF8, BPF_REG_0),	/* cmp eax,key */
+		      keys[a + pivot]);
+	} else {
+		EMIT1(add_1mod(0x48, BPF_REG_3));	/* cmp rdx,func */
+		if (!is_simm32(progs[a + pivot]))
+			return -1;
+		EMIT2_off32(0x81, add_1reg(0xF8, BPF_REG_3), progs[a + pivot]);
+	}
 
 	if (pivot > 2) {				/* jg upper_part */
 		/* Require near jump. */
@@ -1758,7 +2035,7 @@ static int emit_bpf_dispatcher(u8 **pprog, int a, int b, s64 *progs)
 	jg_reloc = prog;
 
 	err = emit_bpf_dispatcher(&prog, a, a + pivot,	/* emit lower_part */
-				  progs);
+				  progs, keys);
 	if (err)
 		return err;
 
@@ -1772,7 +2049,7 @@ static int emit_bpf_dispatcher(u8 **pprog, int a, int b, s64 *progs)
 	emit_code(jg_reloc - jg_bytes, jg_offset, jg_bytes);
 
 	err = emit_bpf_dispatcher(&prog, a + pivot + 1,	/* emit upper_part */
-				  b, progs);
+				  b, progs, keys);
 	if (err)
 		return err;
 
@@ -1792,12 +2069,80 @@ static int cmp_ips(const void *a, const void *b)
 	return 0;
 }
 
+/*
+ * The hash prologue below costs 10 bytes and every inner node of the
+ * hashed search is 4 bytes shorter, so it pays off from 4 programs on.
+ * Keys are compared as imm8, hence at most 7 bits.
+ */
+#define BPF_DISPATCHER_HASH_MIN		4
+#define BPF_DISPATCHER_HASH_BITS	7
+
+static u8 dispatcher_key(s64 func, int shift, int bits)
+{
+	return ((u64)func >> shift) & ((1 << bits) - 1);
+}
+
+/*
+ * Find the fewest consecutive address bits that tell all @funcs apart.
+ * On success, sort @funcs by key, fill in @keys and return the shift of
+ * the lowest bit; otherwise return -1.
+ */
+static int dispatcher_hash(s64 *funcs, int num_funcs, u8 *keys, int *bitsp)
+{
+	DECLARE_BITMAP(seen, 1 << BPF_DISPATCHER_HASH_BITS);
+	int bits, shift, i, j;
+
+	for (bits = order_base_2(num_funcs);
+	     bits <= BPF_DISPATCHER_HASH_BITS; bits++) {
+		for (shift = 0; shift <= 64 - bits; shift++) {
+			bitmap_zero(seen, 1 << bits);
+			for (i = 0; i < num_funcs; i++) {
+				if (__test_and_set_bit(dispatcher_key(funcs[i], shift, bits),
+						       seen))
+					break;
+			}
+			if (i == num_funcs)
+				goto found;
+		}
+	}
+	return -1;
+
+found:
+	for (i = 1; i < num_funcs; i++) {
+		for (j = i; j > 0; j--) {
+			if (dispatcher_key(funcs[j - 1], shift, bits) <
+			    dispatcher_key(funcs[j], shift, bits))
+				break;
+			swap(funcs[j - 1], funcs[j]);
+		}
+	}
+	for (i = 0; i < num_funcs; i++)
+		keys[i] = dispatcher_key(funcs[i], shift, bits);
+	*bitsp = bits;
+	return shift;
+}
+
 int arch_prepare_bpf_dispatcher(void *image, s64 *funcs, int num_funcs)
 {
+	u8 keys[BPF_DISPATCHER_MAX];
+	int shift = -1, bits, cnt = 0;
 	u8 *prog = image;
 
-	sort(funcs, num_funcs, sizeof(funcs[0]), cmp_ips, NULL);
-	return emit_bpf_dispatcher(&prog, 0, num_funcs - 1, funcs);
+	if (num_funcs >= BPF_DISPATCHER_HASH_MIN)
+		shift = dispatcher_hash(funcs, num_funcs, keys, &bits);
+	if (shift < 0) {
+		sort(funcs, num_funcs, sizeof(funcs[0]), cmp_ips, NULL);
+		return emit_bpf_dispatcher(&prog, 0, num_funcs - 1, funcs, NULL);
+	}
+
+	/*
+	 * Jumping through a table indexed by the key would be shorter still,
+	 * but it is the indirect branch the dispatcher exists to avoid.
+	 */
+	emit_mov_reg(&prog, true, BPF_REG_0, BPF_REG_3);	/* mov rax,rdx */
+	EMIT4(0x48, 0xC1, add_1reg(0xE8, BPF_REG_0), shift);	/* shr rax,shift */
+	EMIT3(0x83, add_1reg(0xE0, BPF_REG_0), (1 << bits) - 1); /* and eax,mask */
+	return emit_bpf_dispatcher(&prog, 0, num_funcs - 1, funcs, keys);
 }
 
 struct x64_jit_data {
@@ -1815,11 +2160,13 @@ struct bpf_prog *bpf_int_jit_compile(struct bpf_prog *prog)
 	struct x64_jit_data *jit_data;
 	int proglen, oldproglen = 0;
 	struct jit_context ctx = {};
+	u32 align = __alignof__(struct exception_table_entry);
+	struct jit_layout *layout;
+	u32 extable_size;
 	bool tmp_blinded = false;
 	bool extra_pass = false;
 	u8 *image = NULL;
 	int *addrs;
-	int pass;
 	int i;
 
 	if (!prog->jit_requested)
@@ -1862,7 +2209,7 @@ struct bpf_prog *bpf_int_jit_compile(struct bpf_prog *prog)
 	}
 
 	/*
-	 * Before first pass, make a rough estimation of addrs[]
+	 * Before the layout pass, make a rough estimation of addrs[]
 	 * each BPF instruction is translated to less than 64 bytes
 	 */
 	for (proglen = 0, i = 0; i <= prog->len; i++) {
@@ -1870,58 +2217,59 @@ struct bpf_prog *bpf_int_jit_compile(struct bpf_prog *prog)
 		addrs[i] = proglen;
 	}
 	ctx.cleanup_addr = proglen;
-skip_init_addrs:
+
+	layout = kcalloc(prog->len + 1, sizeof(*layout), GFP_KERNEL);
+	if (!layout) {
+		prog = orig_prog;
+		goto out_addrs;
+	}
 
 	/*
-	 * JITed image shrinks with every pass and the loop iterates
-	 * until the image stops shrinking. Very large BPF programs
-	 * may converge on the last pass. In such case do one more
-	 * pass to emit the final image.
+	 * Only jumps depend on addrs[]. Record where they are in one pass,
+	 * pick their encodings in jit_relax() and emit the image once.
 	 */
-	for (pass = 0; pass < 20 || image; pass++) {
-		proglen = do_jit(prog, addrs, image, oldproglen, &ctx);
-		if (proglen <= 0) {
-out_image:
-			image = NULL;
-			if (header)
-				bpf_jit_binary_free(header);
-			prog = orig_prog;
-			goto out_addrs;
-		}
-		if (image) {
-			if (proglen != oldproglen) {
-				pr_err("bpf_jit: proglen=%d != oldproglen=%d\n",
-				       proglen, oldproglen);
-				goto out_image;
-			}
-			break;
-		}
-		if (proglen == oldproglen) {
-			/*
-			 * The number of entries in extable is the number of BPF_LDX
-			 * insns that access kernel memory via "pointer to BTF type".
-			 * The verifier changed their opcode from LDX|MEM|size
-			 * to LDX|PROBE_MEM|size to make JITing easier.
-			 */
-			u32 align = __alignof__(struct exception_table_entry);
-			u32 extable_size = prog->aux->num_exentries *
-				sizeof(struct exception_table_entry);
-
-			/* allocate module memory for x86 insns and extable */
-			header = bpf_jit_binary_alloc(roundup(proglen, align) + extable_size,
-						      &image, align, jit_fill_hole);
-			if (!header) {
-				prog = orig_prog;
-				goto out_addrs;
-			}
-			prog->aux->extable = (void *) image + roundup(proglen, align);
-		}
-		oldproglen = proglen;
-		cond_resched();
+	proglen = do_jit(prog, addrs, NULL, 0, &ctx, layout);
+	if (proglen > 0)
+		proglen = jit_relax(layout, addrs, prog->len);
+	kfree(layout);
+	if (proglen <= 0) {
+		prog = orig_prog;
+		goto out_addrs;
+	}
+
+	/*
+	 * The number of entries in extable is the number of BPF_LDX
+	 * insns that access kernel memory via "pointer to BTF type".
+	 * The verifier changed their opcode from LDX|MEM|size
+	 * to LDX|PROBE_MEM|size to make JITing easier.
+	 */
+	extable_size = prog->aux->num_exentries *
+		sizeof(struct exception_table_entry);
+
+	/* allocate module memory for x86 insns and extable */
+	header = bpf_jit_binary_alloc(roundup(proglen, align) + extable_size,
+				      &image, align, jit_fill_hole);
+	if (!header) {
+		prog = orig_prog;
+		goto out_addrs;
+	}
+	prog->aux->extable = (void *) image + roundup(proglen, align);
+	oldproglen = proglen;
+skip_init_addrs:
+	proglen = do_jit(prog, addrs, image, oldproglen, &ctx, NULL);
+	if (proglen != oldproglen) {
+		if (proglen > 0)
+			pr_err("bpf_jit: proglen=%d != oldproglen=%d\n",
+			       proglen, oldproglen);
+		image = NULL;
+		if (header)
+			bpf_jit_binary_free(header);
+		prog = orig_prog;
+		goto out_addrs;
 	}
 
 	if (bpf_jit_enable > 1)
-		bpf_jit_dump(prog->len, proglen, pass + 1, image);
+		bpf_jit_dump(prog->len, proglen, extra_pass ? 1 : 2, image);
 
 	if (image) {
 		if (!prog->is_func || extra_pass) {
@@ -11,6 +11,7 @@
 
 #include <linux/netdevice.h>
 #include <linux/filter.h>
+#include <linux/math64.h>
 #include <linux/if_vlan.h>
 #include <asm/cacheflush.h>
 #include <asm/set_memory.h>
@@ -127,6 +128,9 @@ static bool is_simm32(s64 value)
  *    registers.
  * 3. For performance reason, the BPF_REG_AX for blinding constant, is
  *    mapped to real hardware register pair, IA32_ESI and IA32_EDI.
+ * 4. If one of the callee saved registers, R6-R9, is used more often than
+ *    BPF_REG_AX, it takes the IA32_ESI/IA32_EDI pair instead, and
+ *    BPF_REG_AX takes its scratch space (see choose_hw_reg()).
  *
  * As the eBPF registers are all 64 bit registers and IA32 has only 32 bit
  * registers, we have to map each eBPF registers with two IA32 32 bit regs
@@ -254,13 +258,13 @@ static inline void emit_ia32_mov_r(const u8 dst, const u8 src, bool dstk,
 static inline void emit_ia32_mov_r64(const bool is64, const u8 dst[],
 				     const u8 src[], bool dstk,
 				     bool sstk, u8 **pprog,
-				     const struct bpf_prog_aux *aux)
+				     const bool zext)
 {
 	emit_ia32_mov_r(dst_lo, src_lo, dstk, sstk, pprog);
 	if (is64)
 		/* complete 8 byte move */
 		emit_ia32_mov_r(dst_hi, src_hi, dstk, sstk, pprog);
-	else if (!aux->verifier_zext)
+	else if (zext)
 		/* zero out high 4 bytes */
 		emit_ia32_mov_i(dst_hi, 0, dstk, pprog);
 }
@@ -315,7 +319,7 @@ static inline void emit_ia32_mul_r(const u8 dst, const u8 src, bool dstk,
 
 static inline void emit_ia32_to_le_r64(const u8 dst[], s32 val,
 					 bool dstk, u8 **pprog,
-					 const struct bpf_prog_aux *aux)
+					 const bool zext)
 {
 	u8 *prog = *pprog;
 	int cnt = 0;
@@ -336,12 +340,12 @@ static inline void emit_ia32_to_le_r64(const u8 dst[], s32 val,
 		 */
 		EMIT2(0x0F, 0xB7);
 		EMIT1(add_2reg(0xC0, dreg_lo, dreg_lo));
-		if (!aux->verifier_zext)
+		if (zext)
 			/* xor dreg_hi,dreg_hi */
 			EMIT2(0x33, add_2reg(0xC0, dreg_hi, dreg_hi));
 		break;
 	case 32:
-		if (!aux->verifier_zext)
+		if (zext)
 			/* xor dreg_hi,dreg_hi */
 			EMIT2(0x33, add_2reg(0xC0, dreg_hi, dreg_hi));
 		break;
@@ -363,7 +367,7 @@ static inline void emit_ia32_to_le_r64(const u8 dst[], s32 val,
 
 static inline void emit_ia32_to_be_r64(const u8 dst[], s32 val,
 				       bool dstk, u8 **pprog,
-				       const struct bpf_prog_aux *aux)
+				       const bool zext)
 {
 	u8 *prog = *pprog;
 	int cnt = 0;
@@ -385,7 +389,7 @@ static inline void emit_ia32_to_be_r64(const u8 dst[], s32 val,
 		EMIT2(0x0F, 0xB7);
 		EMIT1(add_2reg(0xC0, dreg_lo, dreg_lo));
 
-		if (!aux->verifier_zext)
+		if (zext)
 			/* xor dreg_hi,dreg_hi */
 			EMIT2(0x33, add_2reg(0xC0, dreg_hi, dreg_hi));
 		break;
@@ -394,7 +398,7 @@ static inline void emit_ia32_to_be_r64(const u8 dst[], s32 val,
 		EMIT1(0x0F);
 		EMIT1(add_1reg(0xC8, dreg_lo));
 
-		if (!aux->verifier_zext)
+		if (zext)
 			/* xor dreg_hi,dreg_hi */
 			EMIT2(0x33, add_2reg(0xC0, dreg_hi, dreg_hi));
 		break;
@@ -427,6 +431,55 @@ static inline void emit_ia32_to_be_r64(const u8 dst[], s32 val,
 	*pprog = prog;
 }
 
+/*
+ * ALU operation (64 bit)
+ * dst = dst (div|mod) src
+ *
+ * Calls bpf_jit_udiv64 or bpf_jit_mod64 with the dividend in edx:eax. The
+ * divisor must already be pushed on the stack; it is popped after the call.
+ * jmp_offset is relative to the end of the emitted code.
+ */
+static inline void emit_ia32_div_mod_r64(const u8 dst[], bool dstk,
+					 s64 jmp_offset, u8 **pprog)
+{
+	u8 *prog = *pprog;
+	int cnt = 0;
+
+	if (dstk) {
+		/* mov eax,dword ptr [ebp+off] */
+		EMIT3(0x8B, add_2reg(0x40, IA32_EBP, IA32_EAX),
+		      STACK_VAR(dst_lo));
+		/* mov edx,dword ptr [ebp+off] */
+		EMIT3(0x8B, add_2reg(0x40, IA32_EBP, IA32_EDX),
+		      STACK_VAR(dst_hi));
+
+		EMIT1_off32(0xE8, jmp_offset + 9);
+
+		/* mov dword ptr [ebp+off],eax */
+		EMIT3(0x89, add_2reg(0x40, IA32_EBP, IA32_EAX),
+		      STACK_VAR(dst_lo));
+		/* mov dword ptr [ebp+off],edx */
+		EMIT3(0x89, add_2reg(0x40, IA32_EBP, IA32_EDX),
+		      STACK_VAR(dst_hi));
+	} else {
+		/* mov eax,dst_lo */
+		EMIT2(0x8B, add_2reg(0xC0, dst_lo, IA32_EAX));
+		/* mov edx,dst_hi */
+		EMIT2(0x8B, add_2reg(0xC0, dst_hi, IA32_EDX));
+
+		EMIT1_off32(0xE8, jmp_offset + 7);
+
+		/* mov dst_lo,eax */
+		EMIT2(0x89, add_2reg(0xC0, dst_lo, IA32_EAX));
+		/* mov dst_hi,edx */
+		EMIT2(0x89, add_2reg(0xC0, dst_hi, IA32_EDX));
+	}
+
+	/* add esp,8 */
+	EMIT3(0x83, add_1reg(0xC0, IA32_ESP), 8);
+	*pprog = prog;
+}
+
 /*
  * ALU operation (32 bit)
  * dst = dst (div|mod) src
@@ -526,49 +579,41 @@ static inline void emit_ia32_alu_r(const bool is64, const bool hi, const u8 op,
 	u8 *prog = *pprog;
 	int cnt = 0;
 	u8 sreg = sstk ? IA32_EAX : src;
-	u8 dreg = dstk ? IA32_EDX : dst;
+	u8 opcode;
 
 	if (sstk)
 		/* mov eax,dword ptr [ebp+off] */
 		EMIT3(0x8B, add_2reg(0x40, IA32_EBP, IA32_EAX), STACK_VAR(src));
 
-	if (dstk)
-		/* mov eax,dword ptr [ebp+off] */
-		EMIT3(0x8B, add_2reg(0x40, IA32_EBP, IA32_EDX), STACK_VAR(dst));
-
 	switch (BPF_OP(op)) {
 	/* dst = dst + src */
 	case BPF_ADD:
-		if (hi && is64)
-			EMIT2(0x11, add_2reg(0xC0, dreg, sreg));
-		else
-			EMIT2(0x01, add_2reg(0xC0, dreg, sreg));
+		opcode = hi && is64 ? 0x11 : 0x01;
 		break;
 	/* dst = dst - src */
 	case BPF_SUB:
-		if (hi && is64)
-			EMIT2(0x19, add_2reg(0xC0, dreg, sreg));
-		else
-			EMIT2(0x29, add_2reg(0xC0, dreg, sreg));
+		opcode = hi && is64 ? 0x19 : 0x29;
 		break;
 	/* dst = dst | src */
 	case BPF_OR:
-		EMIT2(0x09, add_2reg(0xC0, dreg, sreg));
+		opcode = 0x09;
 		break;
 	/* dst = dst & src */
 	case BPF_AND:
-		EMIT2(0x21, add_2reg(0xC0, dreg, sreg));
+		opcode = 0x21;
 		break;
 	/* dst = dst ^ src */
-	case BPF_XOR:
-		EMIT2(0x31, add_2reg(0xC0, dreg, sreg));
+	default: /* BPF_XOR */
+		opcode = 0x31;
 		break;
 	}
 
 	if (dstk)
-		/* mov dword ptr [ebp+off],dreg */
-		EMIT3(0x89, add_2reg(0x40, IA32_EBP, dreg),
-		      STACK_VAR(dst));
+		/* op dword ptr [ebp+off],sreg */
+		EMIT3(opcode, add_2reg(0x40, IA32_EBP, sreg), STACK_VAR(dst));
+	else
+		/* op dst,sreg */
+		EMIT2(opcode, add_2reg(0xC0, dst, sreg));
 	*pprog = prog;
 }
 
@@ -576,7 +621,7 @@ static inline void emit_ia32_alu_r(const bool is64, const bool hi, const u8 op,
 static inline void emit_ia32_alu_r64(const bool is64, const u8 op,
 				     const u8 dst[], const u8 src[],
 				     bool dstk,  bool sstk,
-				     u8 **pprog, const struct bpf_prog_aux *aux)
+				     u8 **pprog, const bool zext)
 {
 	u8 *prog = *pprog;
 
@@ -584,7 +629,7 @@ static inline void emit_ia32_alu_r64(const bool is64, const u8 op,
 	if (is64)
 		emit_ia32_alu_r(is64, true, op, dst_hi, src_hi, dstk, sstk,
 				&prog);
-	else if (!aux->verifier_zext)
+	else if (zext)
 		emit_ia32_mov_i(dst_hi, 0, dstk, &prog);
 	*pprog = prog;
 }
@@ -599,76 +644,57 @@ static inline void emit_ia32_alu_i(const bool is64, const bool hi, const u8 op,
 {
 	u8 *prog = *pprog;
 	int cnt = 0;
-	u8 dreg = dstk ? IA32_EAX : dst;
-	u8 sreg = IA32_EDX;
-
-	if (dstk)
-		/* mov eax,dword ptr [ebp+off] */
-		EMIT3(0x8B, add_2reg(0x40, IA32_EBP, IA32_EAX), STACK_VAR(dst));
-
-	if (!is_imm8(val))
-		/* mov edx,imm32*/
-		EMIT2_off32(0xC7, add_1reg(0xC0, IA32_EDX), val);
+	u8 ext; /* Opcode extension in the ModR/M reg field */
 
 	switch (op) {
 	/* dst = dst + val */
 	case BPF_ADD:
-		if (hi && is64) {
-			if (is_imm8(val))
-				EMIT3(0x83, add_1reg(0xD0, dreg), val);
-			else
-				EMIT2(0x11, add_2reg(0xC0, dreg, sreg));
-		} else {
-			if (is_imm8(val))
-				EMIT3(0x83, add_1reg(0xC0, dreg), val);
-			else
-				EMIT2(0x01, add_2reg(0xC0, dreg, sreg));
-		}
+		/* adc or add */
+		ext = hi && is64 ? 0x10 : 0x00;
 		break;
 	/* dst = dst - val */
 	case BPF_SUB:
-		if (hi && is64) {
-			if (is_imm8(val))
-				EMIT3(0x83, add_1reg(0xD8, dreg), val);
-			else
-				EMIT2(0x19, add_2reg(0xC0, dreg, sreg));
-		} else {
-			if (is_imm8(val))
-				EMIT3(0x83, add_1reg(0xE8, dreg), val);
-			else
-				EMIT2(0x29, add_2reg(0xC0, dreg, sreg));
-		}
+		/* sbb or sub */
+		ext = hi && is64 ? 0x18 : 0x28;
 		break;
 	/* dst = dst | val */
 	case BPF_OR:
-		if (is_imm8(val))
-			EMIT3(0x83, add_1reg(0xC8, dreg), val);
-		else
-			EMIT2(0x09, add_2reg(0xC0, dreg, sreg));
+		ext = 0x08;
 		break;
 	/* dst = dst & val */
 	case BPF_AND:
-		if (is_imm8(val))
-			EMIT3(0x83, add_1reg(0xE0, dreg), val);
-		else
-			EMIT2(0x21, add_2reg(0xC0, dreg, sreg));
+		ext = 0x20;
 		break;
 	/* dst = dst ^ val */
 	case BPF_XOR:
-		if (is_imm8(val))
-			EMIT3(0x83, add_1reg(0xF0, dreg), val);
-		else
-			EMIT2(0x31, add_2reg(0xC0, dreg, sreg));
+		ext = 0x30;
 		break;
-	case BPF_NEG:
-		EMIT2(0xF7, add_1reg(0xD8, dreg));
+	/* dst = -dst */
+	default: /* BPF_NEG */
+		ext = 0x18;
 		break;
 	}
 
+	if (op == BPF_NEG)
+		EMIT1(0xF7);
+	else if (is_imm8(val))
+		EMIT1(0x83);
+	else
+		EMIT1(0x81);
+
 	if (dstk)
-		/* mov dword ptr [ebp+off],dreg */
-		EMIT3(0x89, add_2reg(0x40, IA32_EBP, dreg),
-		      STACK_VAR(dst));
+		/* op dword ptr [ebp+off],... */
+		EMIT2(add_1reg(0x40 + ext, IA32_EBP), STACK_VAR(dst));
+	else
+		/* op dst,... */
+		EMIT1(add_1reg(0xC0 + ext, dst));
+
+	if (op != BPF_NEG) {
+		if (is_imm8(val))
+			EMIT1(val);
+		else
+			EMIT(val, 4);
+	}
 	*pprog = prog;
 }
 
@@ -676,7 +702,7 @@ static inline void emit_ia32_alu_i(const bool is64, const bool hi, const u8 op,
 static inline void emit_ia32_alu_i64(const bool is64, const u8 op,
 				     const u8 dst[], const u32 val,
 				     bool dstk, u8 **pprog,
-				     const struct bpf_prog_aux *aux)
+				     const bool zext)
 {
 	u8 *prog = *pprog;
 	u32 hi = 0;
@@ -687,7 +713,7 @@ static inline void emit_ia32_alu_i64(const bool is64, const u8 op,
 	emit_ia32_alu_i(is64, false, op, dst_lo, val, dstk, &prog);
 	if (is64)
 		emit_ia32_alu_i(is64, true, op, dst_hi, hi, dstk, &prog);
-	else if (!aux->verifier_zext)
+	else if (zext)
 		emit_ia32_mov_i(dst_hi, 0, dstk, &prog);
 
 	*pprog = prog;
@@ -698,30 +724,21 @@ static inline void emit_ia32_neg64(const u8 dst[], bool dstk, u8 **pprog)
 {
 	u8 *prog = *pprog;
 	int cnt = 0;
-	u8 dreg_lo = dstk ? IA32_EAX : dst_lo;
-	u8 dreg_hi = dstk ? IA32_EDX : dst_hi;
 
 	if (dstk) {
-		EMIT3(0x8B, add_2reg(0x40, IA32_EBP, IA32_EAX),
-		      STACK_VAR(dst_lo));
-		EMIT3(0x8B, add_2reg(0x40, IA32_EBP, IA32_EDX),
-		      STACK_VAR(dst_hi));
-	}
-
-	/* neg dreg_lo */
-	EMIT2(0xF7, add_1reg(0xD8, dreg_lo));
-	/* adc dreg_hi,0x0 */
-	EMIT3(0x83, add_1reg(0xD0, dreg_hi), 0x00);
-	/* neg dreg_hi */
-	EMIT2(0xF7, add_1reg(0xD8, dreg_hi));
-
-	if (dstk) {
-		/* mov dword ptr [ebp+off],dreg_lo */
-		EMIT3(0x89, add_2reg(0x40, IA32_EBP, dreg_lo),
-		      STACK_VAR(dst_lo));
-		/* mov dword ptr [ebp+off],dreg_hi */
-		EMIT3(0x89, add_2reg(0x40, IA32_EBP, dreg_hi),
-		      STACK_VAR(dst_hi));
+		/* neg dword ptr [ebp+off] */
+		EMIT3(0xF7, add_1reg(0x58, IA32_EBP), STACK_VAR(dst_lo));
+		/* adc dword ptr [ebp+off],0x0 */
+		EMIT4(0x83, add_1reg(0x50, IA32_EBP), STACK_VAR(dst_hi), 0x00);
+		/* neg dword ptr [ebp+off] */
+		EMIT3(0xF7, add_1reg(0x58, IA32_EBP), STACK_VAR(dst_hi));
+	} else {
+		/* neg dst_lo */
+		EMIT2(0xF7, add_1reg(0xD8, dst_lo));
+		/* adc dst_hi,0x0 */
+		EMIT3(0x83, add_1reg(0xD0, dst_hi), 0x00);
+		/* neg dst_hi */
+		EMIT2(0xF7, add_1reg(0xD8, dst_hi));
 	}
 	*pprog = prog;
 }
@@ -1184,8 +1201,60 @@ static int bpf_size_to_x86_bytes(int bpf_size)
 
 struct jit_context {
 	int cleanup_addr; /* Epilogue code offset */
+	u8 hw_reg; /* eBPF register in IA32_ESI/IA32_EDI */
+	unsigned long *jmp_targets; /* eBPF insns that are jump targets */
+	u16 hi_zero; /* eBPF registers whose upper half is zero */
+	bool dst_hi_zero; /* hi_zero included the dst of this insn */
 };
 
+/*
+ * The upper half of dst must be cleared, unless the verifier inserts zext
+ * instructions or it is known to be zero already.
+ */
+static bool need_zext(const struct bpf_prog *prog,
+		      const struct jit_context *ctx)
+{
+	return !prog->aux->verifier_zext && !ctx->dst_hi_zero;
+}
+
+/*
+ * Get the mapping of eBPF register 'reg' for this program. ctx->hw_reg
+ * and BPF_REG_AX swap their entries in bpf2ia32.
+ */
+static const u8 *bpf2ia32_reg(const struct jit_context *ctx, u8 reg)
+{
+	if (reg == ctx->hw_reg)
+		reg = BPF_REG_AX;
+	else if (reg == BPF_REG_AX)
+		reg = ctx->hw_reg;
+	return bpf2ia32[reg];
+}
+
+/*
+ * Choose the eBPF register to keep in IA32_ESI/IA32_EDI, counting the
+ * uses of each register in the program. R0-R5 and FP are not candidates,
+ * as prologue, epilogue, calls and tail calls access their scratch space
+ * directly; R6-R9 are preserved across calls, as ESI/EDI are callee saved.
+ */
+static u8 choose_hw_reg(const struct bpf_prog *prog)
+{
+	unsigned int uses[MAX_BPF_JIT_REG] = {};
+	const struct bpf_insn *insn = prog->insnsi;
+	u8 reg, hw_reg = BPF_REG_AX;
+	int i;
+
+	for (i = 0; i < prog->len; i++, insn++) {
+		uses[insn->dst_reg]++;
+		uses[insn->src_reg]++;
+	}
+
+	for (reg = BPF_REG_6; reg <= BPF_REG_9; reg++)
+		if (uses[reg] > uses[hw_reg])
+			hw_reg = reg;
+
+	return hw_reg;
+}
+
 /* Maximum number of bytes emitted while JITing one eBPF insn */
 #define BPF_MAX_INSN_SIZE	128
 #define BPF_INSN_SAFETY		64
@@ -1272,11 +1341,12 @@ static void emit_epilogue(u8 **pprog, u32 stack_depth)
  * ... bpf_tail_call(void *ctx, struct bpf_array *array, u64 index) ...
  *   if (index >= array->map.max_entries)
  *     goto out;
- *   if (++tail_call_cnt > MAX_TAIL_CALL_CNT)
+ *   if (tail_call_cnt > MAX_TAIL_CALL_CNT)
  *     goto out;
  *   prog = array->ptrs[index];
  *   if (prog == NULL)
  *     goto out;
+ *   tail_call_cnt++;
  *   goto *(prog->bpf_func + prologue_size);
  * out:
  */
@@ -1288,7 +1358,6 @@ static void emit_bpf_tail_call(u8 **pprog)
 	const u8 *r2 = bpf2ia32[BPF_REG_2];
 	const u8 *r3 = bpf2ia32[BPF_REG_3];
 	const u8 *tcc = bpf2ia32[TCALL_CNT];
-	u32 lo, hi;
 	static int jmp_label1 = -1;
 
 	/*
@@ -1309,30 +1378,16 @@ static void emit_bpf_tail_call(u8 **pprog)
 	/*
 	 * if (tail_call_cnt > MAX_TAIL_CALL_CNT)
 	 *     goto out;
+	 *
+	 * The counter never exceeds MAX_TAIL_CALL_CNT + 1, so only its low
+	 * word is read and updated.
 	 */
-	lo = (u32)MAX_TAIL_CALL_CNT;
-	hi = (u32)((u64)MAX_TAIL_CALL_CNT >> 32);
+	/* mov ecx,dword ptr [ebp+off] */
 	EMIT3(0x8B, add_2reg(0x40, IA32_EBP, IA32_ECX), STACK_VAR(tcc[0]));
-	EMIT3(0x8B, add_2reg(0x40, IA32_EBP, IA32_EBX), STACK_VAR(tcc[1]));
-
-	/* cmp edx,hi */
-	EMIT3(0x83, add_1reg(0xF8, IA32_EBX), hi);
-	EMIT2(IA32_JNE, 3);
-	/* cmp ecx,lo */
-	EMIT3(0x83, add_1reg(0xF8, IA32_ECX), lo);
-
+	/* cmp ecx,MAX_TAIL_CALL_CNT */
+	EMIT3(0x83, add_1reg(0xF8, IA32_ECX), MAX_TAIL_CALL_CNT);
 	/* ja out */
-	EMIT2(IA32_JAE, jmp_label(jmp_label1, 2));
-
-	/* add eax,0x1 */
-	EMIT3(0x83, add_1reg(0xC0, IA32_ECX), 0x01);
-	/* adc ebx,0x0 */
-	EMIT3(0x83, add_1reg(0xD0, IA32_EBX), 0x00);
-
-	/* mov dword ptr [ebp+off],eax */
-	EMIT3(0x89, add_2reg(0x40, IA32_EBP, IA32_ECX), STACK_VAR(tcc[0]));
-	/* mov dword ptr [ebp+off],edx */
-	EMIT3(0x89, add_2reg(0x40, IA32_EBP, IA32_EBX), STACK_VAR(tcc[1]));
+	EMIT2(IA32_JA, jmp_label(jmp_label1, 2));
 
 	/* prog = array->ptrs[index]; */
 	/* mov edx, [eax + edx * 4 + offsetof(...)] */
@@ -1347,6 +1402,12 @@ static void emit_bpf_tail_call(u8 **pprog)
 	/* je out */
 	EMIT2(IA32_JE, jmp_label(jmp_label1, 2));
 
+	/* tail_call_cnt++; only written back once the jump is certain */
+	/* add ecx,0x1 */
+	EMIT3(0x83, add_1reg(0xC0, IA32_ECX), 0x01);
+	/* mov dword ptr [ebp+off],ecx */
+	EMIT3(0x89, add_2reg(0x40, IA32_EBP, IA32_ECX), STACK_VAR(tcc[0]));
+
 	/* goto *(prog->bpf_func + prologue_size); */
 	/* mov edx, dword ptr [edx + 32] */
 	EMIT3(0x8B, add_2reg(0x40, IA32_EDX, IA32_EDX),
@@ -1475,17 +1536,26 @@ static int do_jit(struct bpf_prog *bpf_prog, int *addrs, u8 *image,
 	for (i = 0; i < insn_cnt; i++, insn++) {
 		const s32 imm32 = insn->imm;
 		const bool is64 = BPF_CLASS(insn->code) == BPF_ALU64;
-		const bool dstk = insn->dst_reg != BPF_REG_AX;
-		const bool sstk = insn->src_reg != BPF_REG_AX;
+		const bool dstk = insn->dst_reg != ctx->hw_reg;
+		const bool sstk = insn->src_reg != ctx->hw_reg;
 		const u8 code = insn->code;
-		const u8 *dst = bpf2ia32[insn->dst_reg];
-		const u8 *src = bpf2ia32[insn->src_reg];
+		const u8 *dst = bpf2ia32_reg(ctx, insn->dst_reg);
+		const u8 *src = bpf2ia32_reg(ctx, insn->src_reg);
 		const u8 *r0 = bpf2ia32[BPF_REG_0];
 		s64 jmp_offset;
 		u8 jmp_cond;
+		bool zext;
 		int ilen;
 		u8 *func;
 
+		/* Upper halves are unknown on entry and at jump targets. */
+		if (!i || test_bit(i, ctx->jmp_targets))
+			ctx->hi_zero = 0;
+		ctx->dst_hi_zero = ctx->hi_zero & BIT(insn->dst_reg);
+		ctx->hi_zero = bpf_jit_hi_zero_next(insn, ctx->hi_zero,
+						    bpf_prog->aux->verifier_zext);
+		zext = need_zext(bpf_prog, ctx);
+
 		switch (code) {
 		/* ALU operations */
 		/* dst = src */
@@ -1497,11 +1567,13 @@ static int do_jit(struct bpf_prog *bpf_prog, int *addrs, u8 *image,
 			case BPF_X:
 				if (imm32 == 1) {
 					/* Special mov32 for zext. */
-					emit_ia32_mov_i(dst_hi, 0, dstk, &prog);
+					if (!ctx->dst_hi_zero)
+						emit_ia32_mov_i(dst_hi, 0, dstk,
+								&prog);
 					break;
 				}
 				emit_ia32_mov_r64(is64, dst, src, dstk, sstk,
-						  &prog, bpf_prog->aux);
+						  &prog, zext);
 				break;
 			case BPF_K:
 				/* Sign-extend immediate value to dst reg */
@@ -1542,12 +1614,12 @@ static int do_jit(struct bpf_prog *bpf_prog, int *addrs, u8 *image,
 			case BPF_X:
 				emit_ia32_alu_r64(is64, BPF_OP(code), dst,
 						  src, dstk, sstk, &prog,
-						  bpf_prog->aux);
+						  zext);
 				break;
 			case BPF_K:
 				emit_ia32_alu_i64(is64, BPF_OP(code), dst,
 						  imm32, dstk, &prog,
-						  bpf_prog->aux);
+						  zext);
 				break;
 			}
 			break;
@@ -1566,7 +1638,7 @@ static int do_jit(struct bpf_prog *bpf_prog, int *addrs, u8 *image,
 						false, &prog);
 				break;
 			}
-			if (!bpf_prog->aux->verifier_zext)
+			if (zext)
 				emit_ia32_mov_i(dst_hi, 0, dstk, &prog);
 			break;
 		case BPF_ALU | BPF_LSH | BPF_X:
@@ -1587,7 +1659,7 @@ static int do_jit(struct bpf_prog *bpf_prog, int *addrs, u8 *image,
 						  &prog);
 				break;
 			}
-			if (!bpf_prog->aux->verifier_zext)
+			if (zext)
 				emit_ia32_mov_i(dst_hi, 0, dstk, &prog);
 			break;
 		/* dst = dst / src(imm) */
@@ -1610,14 +1682,36 @@ static int do_jit(struct bpf_prog *bpf_prog, int *addrs, u8 *image,
 						    &prog);
 				break;
 			}
-			if (!bpf_prog->aux->verifier_zext)
+			if (zext)
 				emit_ia32_mov_i(dst_hi, 0, dstk, &prog);
 			break;
 		case BPF_ALU64 | BPF_DIV | BPF_K:
 		case BPF_ALU64 | BPF_DIV | BPF_X:
 		case BPF_ALU64 | BPF_MOD | BPF_K:
 		case BPF_ALU64 | BPF_MOD | BPF_X:
-			goto notyet;
+			func = (u8 *)(BPF_OP(code) == BPF_DIV ?
+				      bpf_jit_udiv64 : bpf_jit_mod64);
+			jmp_offset = func - (image + addrs[i]);
+
+			switch (BPF_SRC(code)) {
+			case BPF_X:
+				if (sstk) {
+					emit_push_r64(src, &prog);
+				} else {
+					/* push src_hi */
+					EMIT1(add_1reg(0x50, src_hi));
+					/* push src_lo */
+					EMIT1(add_1reg(0x50, src_lo));
+				}
+				break;
+			case BPF_K:
+				/* push imm32 sign-extended to 64 bits */
+				EMIT2(0x6A, imm32 < 0 ? 0xFF : 0x00);
+				EMIT1_off32(0x68, imm32);
+				break;
+			}
+			emit_ia32_div_mod_r64(dst, dstk, jmp_offset, &prog);
+			break;
 		/* dst = dst >> imm */
 		/* dst = dst << imm */
 		case BPF_ALU | BPF_RSH | BPF_K:
@@ -1628,7 +1722,7 @@ static int do_jit(struct bpf_prog *bpf_prog, int *addrs, u8 *image,
 			EMIT2_off32(0xC7, add_1reg(0xC0, IA32_ECX), imm32);
 			emit_ia32_shift_r(BPF_OP(code), dst_lo, IA32_ECX, dstk,
 					  false, &prog);
-			if (!bpf_prog->aux->verifier_zext)
+			if (zext)
 				emit_ia32_mov_i(dst_hi, 0, dstk, &prog);
 			break;
 		/* dst = dst << imm */
@@ -1665,7 +1759,7 @@ static int do_jit(struct bpf_prog *bpf_prog, int *addrs, u8 *image,
 		case BPF_ALU | BPF_NEG:
 			emit_ia32_alu_i(is64, false, BPF_OP(code),
 					dst_lo, 0, dstk, &prog);
-			if (!bpf_prog->aux->verifier_zext)
+			if (zext)
 				emit_ia32_mov_i(dst_hi, 0, dstk, &prog);
 			break;
 		/* dst = ~dst (64 bit) */
@@ -1687,12 +1781,12 @@ static int do_jit(struct bpf_prog *bpf_prog, int *addrs, u8 *image,
 		/* dst = htole(dst) */
 		case BPF_ALU | BPF_END | BPF_FROM_LE:
 			emit_ia32_to_le_r64(dst, imm32, dstk, &prog,
-					    bpf_prog->aux);
+					    zext);
 			break;
 		/* dst = htobe(dst) */
 		case BPF_ALU | BPF_END | BPF_FROM_BE:
 			emit_ia32_to_be_r64(dst, imm32, dstk, &prog,
-					    bpf_prog->aux);
+					    zext);
 			break;
 		/* dst = imm64 */
 		case BPF_LD | BPF_IMM | BPF_DW: {
@@ -1847,7 +1941,7 @@ static int do_jit(struct bpf_prog *bpf_prog, int *addrs, u8 *image,
 			case BPF_B:
 			case BPF_H:
 			case BPF_W:
-				if (bpf_prog->aux->verifier_zext)
+				if (!zext)
 					break;
 				if (dstk) {
 					EMIT3(0xC7, add_1reg(0x40, IA32_EBP),
@@ -2323,10 +2417,17 @@ struct bpf_prog *bpf_int_jit_compile(struct bpf_prog *prog)
 		prog = tmp;
 	}
 
+	ctx.jmp_targets = bitmap_zalloc(prog->len, GFP_KERNEL);
+	if (!ctx.jmp_targets) {
+		prog = orig_prog;
+		goto out;
+	}
+	bpf_jit_mark_jmp_targets(prog->insnsi, prog->len, ctx.jmp_targets);
+
 	addrs = kmalloc_array(prog->len, sizeof(*addrs), GFP_KERNEL);
 	if (!addrs) {
 		prog = orig_prog;
-		goto out;
+		goto out_targets;
 	}
 
 	/*
@@ -2338,6 +2439,7 @@ struct bpf_prog *bpf_int_jit_compile(struct bpf_prog *prog)
 		addrs[i] = proglen;
 	}
 	ctx.cleanup_addr = proglen;
+	ctx.hw_reg = choose_hw_reg(prog);
 
 	/*
 	 * JITed image shrinks with every pass and the loop iterates
@@ -2389,6 +2491,8 @@ out_image:
 
 out_addrs:
 	kfree(addrs);
+out_targets:
+	bitmap_free(ctx.jmp_targets);
 out:
 	if (tmp_blinded)
 		bpf_jit_prog_release_other(prog, prog == orig_prog ?
@@ -20,6 +20,7 @@
 #include <linux/kallsyms.h>
 #include <linux/if_vlan.h>
 #include <linux/vmalloc.h>
+#include <linux/math64.h>
 #include <crypto/sha.h>
 
 #include <net/sch_generic.h>
@@ -178,6 +179,147 @@ static inline bool insn_is_zext(const struct bpf_insn *insn)
 	return insn->code == (BPF_ALU | BPF_MOV | BPF_X) && insn->imm == 1;
 }
 
+/*
+ * For 32-bit JITs: given the BIT(reg) mask of BPF registers whose upper
+ * half is known to be zero before @insn, return the mask after it.  The
+ * JIT itself zero-extends ALU32 and narrow LDX results unless the verifier
+ * inserts explicit zext instructions, so those set the destination bit.
+ * ALU64 moves and bitwise operations whose operands have zero upper
+ * halves keep the destination's upper half zero as well.  Jump targets
+ * must start over from an empty mask.
+ */
+static inline u16 bpf_jit_hi_zero_next(const struct bpf_insn *insn,
+				       u16 hi_zero, bool verifier_zext)
+{
+	u8 code = insn->code;
+	u16 dst = BIT(insn->dst_reg);
+	bool dst_zero, src_zero, zero;
+
+	switch (BPF_CLASS(code)) {
+	case BPF_ALU:
+		if (insn_is_zext(insn))
+			return hi_zero | dst;
+		if (verifier_zext || (BPF_OP(code) == BPF_END && insn->imm == 64))
+			return hi_zero & ~dst;
+		return hi_zero | dst;
+	case BPF_ALU64:
+		dst_zero = hi_zero & dst;
+		src_zero = BPF_SRC(code) == BPF_K ? insn->imm >= 0 :
+			   hi_zero & BIT(insn->src_reg);
+		switch (BPF_OP(code)) {
+		case BPF_MOV:
+			zero = src_zero;
+			break;
+		case BPF_AND:
+			zero = dst_zero || src_zero;
+			break;
+		case BPF_OR:
+		case BPF_XOR:
+			zero = dst_zero && src_zero;
+			break;
+		case BPF_RSH:
+			zero = dst_zero ||
+			       (BPF_SRC(code) == BPF_K && insn->imm >= 32);
+			break;
+		default:
+			zero = false;
+			break;
+		}
+		return zero ? hi_zero | dst : hi_zero & ~dst;
+	case BPF_LDX:
+		if (BPF_SIZE(code) == BPF_DW || verifier_zext)
+			return hi_zero & ~dst;
+		return hi_zero | dst;
+	case BPF_LD:
+		return hi_zero & ~dst;
+	case BPF_JMP:
+		if (BPF_OP(code) == BPF_CALL)
+			return hi_zero & ~GENMASK(BPF_REG_5, BPF_REG_0);
+		if (BPF_OP(code) == BPF_TAIL_CALL)
+			return 0;
+		return hi_zero;
+	default:
+		return hi_zero;
+	}
+}
+
+/*
+ * For JITs that track state across instructions: set the bit of each insn
+ * that is the target of a jump in @insn[0..@len) in @jmp_targets.
+ */
+static inline void bpf_jit_mark_jmp_targets(const struct bpf_insn *insn,
+					    int len,
+					    unsigned long *jmp_targets)
+{
+	int i, target;
+
+	for (i = 0; i < len; i++, insn++) {
+		const u8 op = BPF_OP(insn->code);
+
+		if (BPF_CLASS(insn->code) != BPF_JMP &&
+		    BPF_CLASS(insn->code) != BPF_JMP32)
+			continue;
+		if (op == BPF_CALL || op == BPF_EXIT || op == BPF_TAIL_CALL)
+			continue;
+
+		target = i + insn->off + 1;
+		if (target >= 0 && target < len)
+			__set_bit(target, jmp_targets);
+	}
+}
+
+/*
+ * For 64-bit JITs: magic number for unsigned division by a constant @d
+ * that is neither zero nor a power of two (Granlund and Montgomery,
+ * "Division by Invariant Integers using Multiplication", Figure 4.1).
+ * With l = ceil(log2(d)), the magic is 2^64 * (2^l - d) / d + 1 and
+ *
+ *   q = mulhu(x, magic);
+ *   x / d == (((x - q) >> 1) + q) >> (l - 1)
+ *
+ * for any u64 x.  @shift is set to l - 1.  The same sequence computes a
+ * u32 division when x and d are zero-extended.
+ */
+static inline u64 bpf_jit_udiv_magic(u64 d, u32 *shift)
+{
+	u32 l = fls64(d - 1);
+	u64 r = (l == 64 ? 0 : BIT_ULL(l)) - d;
+	u64 m = 0;
+	int i;
+
+	/* Long division of r * 2^64 by d; r < d, so the quotient fits. */
+	for (i = 0; i < 64; i++) {
+		bool carry = r >> 63;
+
+		r <<= 1;
+		m <<= 1;
+		if (carry || r >= d) {
+			r -= d;
+			m |= 1;
+		}
+	}
+
+	*shift = l - 1;
+	return m + 1;
+}
+
+/*
+ * For 32-bit JITs with no instruction that divides a 64-bit value: the
+ * out-of-line BPF_DIV and BPF_MOD that the JITed code calls.
+ */
+static inline u64 bpf_jit_udiv64(u64 dividend, u64 divisor)
+{
+	return div64_u64(dividend, divisor);
+}
+
+static inline u64 bpf_jit_mod64(u64 dividend, u64 divisor)
+{
+	u64 rem;
+
+	div64_u64_rem(dividend, divisor, &rem);
+	return rem;
+}
+
 /* BPF_LD_IMM64 macro encodes single 'load 64-bit immediate' insn */
 #define BPF_LD_IMM64(DST, IMM)					\
 	BPF_LD_IMM64_RAW(DST, 0, IMM)
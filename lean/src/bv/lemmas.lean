@@ -587,6 +587,22 @@ begin
   apply pow_le_pow_of_le_right two_pos h
 end
 
+lemma mul_shl_one (v₁ v₂ : bv (n + 1)) :
+  v₁ * (1 : bv (n + 1)).shl v₂ = v₁.shl v₂ :=
+begin
+  push_cast [← to_nat_inj],
+  simp only [one_mul],
+  conv_lhs { rw [mul_mod, mod_mod, ← mul_mod] }
+end
+
+lemma udiv_shl_one (v₁ v₂ : bv (n + 1)) (h : (v₂ : ℕ) < n + 1) :
+  v₁ / (1 : bv (n + 1)).shl v₂ = v₁.lshr v₂ :=
+begin
+  have hlt : 2^(v₂ : ℕ) < 2^(n + 1) := nat.pow_lt_pow_of_lt_right (by norm_num) h,
+  push_cast [← to_nat_inj],
+  simp [mod_eq_of_lt hlt, ne_of_gt (pow2_pos _)]
+end
+
 end bitwise
 
 section order
@@ -605,6 +621,15 @@ begin
   norm_cast
 end
 
+lemma udiv_ule (v₁ v₂ : bv n) (h : v₂ ≠ 0) :
+  v₁ / v₂ ≤ v₁ :=
+begin
+  have h' : (v₂ : ℕ) ≠ 0 := λ hz, h (by rw [← to_nat_inj, hz, zero_to_nat]),
+  apply (ule_to_nat _ _).mp,
+  rw [udiv_to_nat, if_neg h'],
+  apply nat.div_le_self
+end
+
 protected lemma ule_refl (v : bv n) : v ≤ v :=
 by simp [← ule_to_nat]
 
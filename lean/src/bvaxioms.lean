@@ -4,7 +4,9 @@ import bv.lemmas
 Theorems for bitvector axiomatization:
 
 * mulhu_comm, mul_decomp: implement 64-bit multiplication using 32-bit operations;
-* urem_of_sub_mul_udiv: implement urem using sub, mul, and udiv.
+* urem_of_sub_mul_udiv: implement urem using sub, mul, and udiv;
+* udiv_zero_extend, udiv_magic: implement division by a constant using
+  64-bit mulhu and shifts (see also udiv_shl_one and mul_shl_one).
 -/
 
 open nat
@@ -106,3 +108,111 @@ theorem urem_eq_sub_mul_udiv {n : ℕ} (x y : bv n) :
 calc x % y
     = x % y + y * (x / y) - (x / y) * y : by ring
 ... = x - (x / y) * y : by rw urem_add_udiv
+
+
+-- 32-bit division can be done on zero-extended operands:
+-- x / y = (zext(x) / zext(y))[31:0]
+
+theorem udiv_zero_extend {n : ℕ} (x y : bv n) (h : y ≠ 0) :
+  take n (zero_extend n x / zero_extend n y) = x / y :=
+begin
+  have hy : (y : ℕ) ≠ 0 := λ hz, h (by rw [← to_nat_inj, hz, zero_to_nat]),
+  rw [← to_nat_inj, take_to_nat, udiv_to_nat, udiv_to_nat],
+  rw [zero_extend_to_nat, zero_extend_to_nat, if_neg hy, if_neg hy],
+  apply mod_eq_of_lt,
+  apply lt_of_le_of_lt (nat.div_le_self _ _) (to_nat_lt _)
+end
+
+
+-- Division by a constant d that is not a power of two, where
+-- 2^(l - 1) < d < 2^l, can be done using mulhu and shifts (Granlund and
+-- Montgomery, "Division by Invariant Integers using Multiplication", 1994):
+-- q = mulhu(x, m)
+-- x / d = (((x - q) >> 1) + q) >> (l - 1)
+-- where m = 2^N * (2^l - d) / d + 1.
+--
+-- This is how bpf_jit_udiv_magic is used by the riscv64 and x86_64 JITs.
+
+private lemma magic_div {N l c d m x : ℕ} (hl : 2^l < 2 * d) (hx : x < 2^N)
+  (hc : 2^l = d + c) (hm : m = 2^N * c / d + 1) :
+  (x + x * m / 2^N) / 2^l = x / d :=
+begin
+  have hd0 : 0 < d, { have := pow2_pos l, linarith },
+  have hdar : d * (2^N * c / d) + 2^N * c % d = 2^N * c := nat.div_add_mod _ _,
+  obtain ⟨k, hk⟩ : ∃ k, d = 2^N * c % d + k + 1 := nat.exists_eq_add_of_lt (nat.mod_lt _ hd0),
+  generalize_hyp : 2^N * c / d = a at hm hdar,
+  generalize_hyp : 2^N * c % d = r at hdar hk,
+  -- (2^N + m) * d = 2^(N + l) + e, where 0 < e = k + 1 ≤ d
+  have key : (2^N + m) * d = 2^N * 2^l + (k + 1),
+  { rw [hm, hc], linarith },
+  have hP : x + x * m / 2^N = (2^N + m) * x / 2^N,
+  { rw [add_mul, nat.mul_add_div (pow2_pos N), mul_comm m] },
+  rw [hP, nat.div_div_eq_div_mul],
+  have hxd : d * (x / d) + x % d = x := nat.div_add_mod _ _,
+  obtain ⟨j, hj⟩ : ∃ j, d = x % d + j + 1 := nat.exists_eq_add_of_lt (nat.mod_lt _ hd0),
+  generalize_hyp : x / d = q at hxd ⊢,
+  generalize_hyp : x % d = s at hxd hj,
+  have hkx : (k + 1) * x < 2^l * 2^N :=
+    mul_lt_mul' (by linarith) hx (nat.zero_le _) (pow2_pos l),
+  have e₁ : (2^N + m) * x * d = (2^N * 2^l + (k + 1)) * x := by rw ← key; ring,
+  have e₂ : (d * q + s) * (2^N * 2^l) = x * (2^N * 2^l) := by rw hxd,
+  apply nat.div_eq_of_lt_le,
+  { apply le_of_mul_le_mul_right _ hd0,
+    nlinarith [nat.zero_le (s * (2^N * 2^l)), nat.zero_le ((k + 1) * x)] },
+  { apply lt_of_mul_lt_mul_right _ (nat.zero_le d),
+    have e₃ : 2^N * 2^l * d = 2^N * 2^l * (s + j + 1) := by rw ← hj,
+    rw nat.succ_eq_add_one,
+    nlinarith [nat.zero_le (2^N * 2^l * j)] }
+end
+
+theorem udiv_magic {n : ℕ} (x d m : bv (n + 1)) (l : ℕ)
+  (hd : (d : ℕ) < 2^l) (hl : 2^l < 2 * (d : ℕ))
+  (hm : m = bv.of_nat (2^(n + 1) * (2^l - d) / d + 1)) :
+  x / d = ((x - mulhu x m).lshr 1 + mulhu x m).lshr (bv.of_nat (l - 1)) :=
+begin
+  have hd0 : 0 < (d : ℕ), { have := pow2_pos l, linarith },
+  have hl1 : 1 ≤ l,
+  { apply nat.pos_of_ne_zero, rintro rfl, norm_num at hd, linarith },
+  have hln : l < n + 1 + 1,
+  { apply (nat.pow_lt_iff_lt_right (le_refl 2)).mp,
+    rw pow_succ 2 (n + 1),
+    linarith [to_nat_lt d] },
+  obtain ⟨c, hc⟩ : ∃ c, 2^l = (d : ℕ) + c := nat.exists_eq_add_of_le (le_of_lt hd),
+  have hcd : c + 1 ≤ d, { linarith },
+  rw [hc, nat.add_sub_cancel_left] at hm,
+  -- the magic number fits in n + 1 bits
+  have hm' : (m : ℕ) = 2^(n + 1) * c / d + 1,
+  { rw [hm, to_of_nat],
+    apply mod_eq_of_lt,
+    apply lt_of_mul_lt_mul_right _ (nat.zero_le (d : ℕ)),
+    have h₁ := nat.div_mul_le_self (2^(n + 1) * c) d,
+    have h₂ := nat.mul_le_mul_left (2^(n + 1)) hcd,
+    nlinarith [to_nat_lt d] },
+  have hq : (mulhu x m : ℕ) = x * m / 2^(n + 1),
+  { unfold mulhu,
+    rw [drop_to_nat, mul_to_nat, zero_extend_to_nat, zero_extend_to_nat, mod_eq_of_lt],
+    rw pow_add,
+    exact mul_lt_mul'' (to_nat_lt _) (to_nat_lt _) (nat.zero_le _) (nat.zero_le _) },
+  have hqx : (mulhu x m : ℕ) ≤ x,
+  { rw hq,
+    apply nat.div_le_of_le_mul,
+    nlinarith [to_nat_lt m] },
+  have hsum : ((x : ℕ) - mulhu x m) / 2^1 + mulhu x m = (x + mulhu x m) / 2 :=
+    calc ((x : ℕ) - mulhu x m) / 2^1 + mulhu x m
+        = (x - mulhu x m + mulhu x m * 2) / 2 : by rw [pow_one, nat.add_mul_div_right _ _ two_pos]
+    ... = (x - mulhu x m + mulhu x m + mulhu x m) / 2 : by ring
+    ... = (x + mulhu x m) / 2 : by rw nat.sub_add_cancel hqx,
+  have hlt : ((x : ℕ) + mulhu x m) / 2 < 2^(n + 1),
+  { apply lt_of_le_of_lt _ (to_nat_lt x),
+    apply nat.div_le_of_le_mul,
+    linarith },
+  have hs : ((bv.of_nat (l - 1) : bv (n + 1)) : ℕ) = l - 1,
+  { rw to_of_nat,
+    apply mod_eq_of_lt,
+    apply lt_trans (by omega : l - 1 < n + 1) (nat.lt_two_pow _) },
+  rw [← to_nat_inj, udiv_to_nat, if_neg (ne_of_gt hd0)],
+  rw [lshr_to_nat, add_to_nat, lshr_to_nat, sub_to_nat, if_pos hqx, one_to_nat, hs],
+  rw [hsum, mod_eq_of_lt hlt, nat.div_div_eq_div_mul, ← pow_succ, nat.sub_add_cancel hl1],
+  rw [hq, hm'],
+  exact (magic_div hl (to_nat_lt x) hc rfl).symm
+end